@@ -7,6 +7,8 @@
 #include <cstring>
 #include <unistd.h>  // for close()
 #include <sys/select.h>  // for select()
+#include <string>
+#include "proto.h"
 
 #define DEST_PORT "12346"  /* arbitrary, but client and server must agree */
 #define BUF_SIZE 4096
@@ -38,6 +40,12 @@ void handleServerError(const string &message) {
             case 4:
                 cerr << "Error: Unknown message format. Please check your input." << endl;
                 break;
+            case 5:
+                cerr << "Error: Register first, and join a room before leaving it or messaging it." << endl;
+                break;
+            case 6:
+                cerr << "Error: Resume refused or session expired. Please register again." << endl;
+                break;
             default:
                 cerr << "Error: Unrecognized error code." << endl;
                 break;
@@ -45,6 +53,196 @@ void handleServerError(const string &message) {
     }
 }
 
+/*
+ * Function: printServerMessage
+ * Purpose: This function prints one message from the server, or the error it stands for
+ * Parameters: The message
+*/
+void printServerMessage(const string &message) {
+    // Check if it's an error message and handle it
+    if (message.substr(0, 3) == "ERR") {
+        handleServerError(message);  // Decipher and print the error message
+    }
+    // If the message starts with MESG, it's a broadcast and print out the message and who it's from
+    else if(message.substr(0, 4) == "MESG") {
+        cout << "From " << message << endl;
+    }
+    // If the message starts with PMSG, it's a private message and just print out the message
+    else if(message.substr(0, 4) == "PMSG") {
+        cout << message << endl;  // Private message from other user
+    }
+    // Otherwise just print ant input out
+    else{
+        cout << message << endl;
+    }
+}
+
+/*
+ * Function: sendFrame
+ * Purpose: This function sends one protocol v2 frame
+ * Parameters: The socket, the opcode, the sequence number, and the payload
+*/
+bool sendFrame(int sockfd, uint8_t opcode, uint32_t seq, const string &payload) {
+    V2Header header;
+    header.length = payload.size();
+    header.opcode = opcode;
+    header.flags = 0;
+    header.seq = seq;
+    string frame(V2_HEADER_SIZE, '\0');
+    v2Encode((unsigned char *)&frame[0], header);
+    frame += payload;
+    return send(sockfd, frame.data(), frame.size(), 0) == (ssize_t)frame.size();
+}
+
+/*
+ * Function: sendCommandFrame
+ * Purpose: This function turns a typed command into a v2 frame and sends it
+ * Parameters: The socket, the command line, and the sequence number to use
+*/
+void sendCommandFrame(int sockfd, const string &line, uint32_t seq) {
+    size_t space = line.find(' ');
+    string command = line.substr(0, space);
+    string rest = (space == string::npos) ? "" : line.substr(space + 1);
+
+    if (command == "REG") {
+        sendFrame(sockfd, V2_REG, seq, rest);
+    }
+    else if (command == "MESG") {
+        sendFrame(sockfd, V2_MESG, seq, rest);
+    }
+    else if (command == "PMSG" || command == "RMSG") {
+        // One byte of recipient (or room) length, the recipient, then the message
+        size_t split = rest.find(' ');
+        if (split == string::npos || split == 0 || split > 255) {
+            cerr << "Error: Unknown message format. Please check your input." << endl;
+            return;
+        }
+        string payload(1, (char)split);
+        payload += rest.substr(0, split) + rest.substr(split + 1);
+        sendFrame(sockfd, command == "PMSG" ? V2_PMSG : V2_RMSG, seq, payload);
+    }
+    else if (command == "JOIN") {
+        sendFrame(sockfd, V2_JOIN, seq, rest);
+    }
+    else if (command == "PART") {
+        sendFrame(sockfd, V2_PART, seq, rest);
+    }
+    else if (command == "HIST") {
+        // One byte of room length, the room, then the count as two bytes if one was given
+        size_t split = rest.find(' ');
+        string room = rest.substr(0, split);
+        string count = (split == string::npos) ? "" : rest.substr(split + 1);
+        if (count.empty() && !room.empty() && room.find_first_not_of("0123456789") == string::npos) {
+            count = room;
+            room.clear();
+        }
+        if (room.size() > 255 || count.find_first_not_of("0123456789") != string::npos || count.size() > 5) {
+            cerr << "Error: Unknown message format. Please check your input." << endl;
+            return;
+        }
+        string payload(1, (char)room.size());
+        payload += room;
+        if (!count.empty()) {
+            int n = atoi(count.c_str());
+            if (n > 65535) {
+                n = 65535;
+            }
+            payload += (char)(n >> 8);
+            payload += (char)(n & 0xff);
+        }
+        sendFrame(sockfd, V2_HIST, seq, payload);
+    }
+    else if (command == "RESUME" || command == "ACK") {
+        // RESUME alone asks for a token; otherwise the token (RESUME only) then the position as eight bytes
+        size_t split = rest.rfind(' ');
+        string token = (split == string::npos) ? "" : rest.substr(0, split);
+        string position = (split == string::npos) ? rest : rest.substr(split + 1);
+        bool resume = command == "RESUME";
+        if ((resume && !rest.empty() && token.empty()) || (!resume && !token.empty()) ||
+            (!rest.empty() && (position.empty() || position.size() > 19 ||
+                               position.find_first_not_of("0123456789") != string::npos))) {
+            cerr << "Error: Unknown message format. Please check your input." << endl;
+            return;
+        }
+        string payload = token;
+        if (!position.empty()) {
+            unsigned char raw[8];
+            v2Put64(raw, strtoull(position.c_str(), NULL, 10));
+            payload.append((const char *)raw, 8);
+        }
+        sendFrame(sockfd, resume ? V2_RESUME : V2_ACK, seq, payload);
+    }
+    else if (command == "LIST") {
+        // The cursor as four bytes if one was given, then the page size as two bytes if that was too
+        size_t split = rest.find(' ');
+        string cursor = rest.substr(0, split);
+        string count = (split == string::npos) ? "" : rest.substr(split + 1);
+        if (cursor.find_first_not_of("0123456789") != string::npos || cursor.size() > 10 ||
+            count.find_first_not_of("0123456789") != string::npos || count.size() > 5) {
+            cerr << "Error: Unknown message format. Please check your input." << endl;
+            return;
+        }
+        string payload;
+        if (!cursor.empty()) {
+            unsigned long long n = strtoull(cursor.c_str(), NULL, 10);
+            if (n > 0xffffffffULL) {
+                n = 0xffffffffULL;
+            }
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                payload += (char)((n >> shift) & 0xff);
+            }
+        }
+        if (!count.empty()) {
+            int n = atoi(count.c_str());
+            if (n > 65535) {
+                n = 65535;
+            }
+            payload += (char)(n >> 8);
+            payload += (char)(n & 0xff);
+        }
+        sendFrame(sockfd, V2_LIST, seq, payload);
+    }
+    else if (line == "DELTAS") {
+        sendFrame(sockfd, V2_DELTAS, seq, "");
+    }
+    else if (line == "EXIT") {
+        sendFrame(sockfd, V2_EXIT, seq, "");
+    }
+    else {
+        cerr << "Error: Unknown message format. Please check your input." << endl;
+    }
+}
+
+/*
+ * Function: negotiateV2
+ * Purpose: This function asks the server for protocol v2 and waits up to two seconds for its hello
+ * Parameters: The socket
+ * Returns: true if the server agreed
+*/
+bool negotiateV2(int sockfd) {
+    if (send(sockfd, V2_PREFACE, V2_PREFACE_LEN, 0) != V2_PREFACE_LEN) {
+        return false;
+    }
+    unsigned char raw[V2_HEADER_SIZE];
+    size_t got = 0;
+    while (got < V2_HEADER_SIZE) {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(sockfd, &readfds);
+        struct timeval timeout = {2, 0};
+        if (select(sockfd + 1, &readfds, NULL, NULL, &timeout) <= 0) {
+            return false;
+        }
+        ssize_t n = recv(sockfd, raw + got, V2_HEADER_SIZE - got, 0);
+        if (n <= 0) {
+            return false;
+        }
+        got += n;
+    }
+    V2Header header = v2Decode(raw);
+    return header.opcode == V2_HELLO && header.length == 0;
+}
+
 
 int main(int argc, char **argv) {
     int sockfd;
@@ -55,12 +253,13 @@ int main(int argc, char **argv) {
     hints.ai_socktype = SOCK_STREAM; // TCP stream socket
 
     // Get server address information
-    if (argc != 2) {
-        cout << "Usage: client <server-name>" << endl;
+    bool use_v2 = argc == 3 && strcmp(argv[1], "--v2") == 0;
+    if (argc != 2 && !use_v2) {
+        cout << "Usage: client [--v2] <server-name>" << endl;
         exit(1);
     }
 
-    if ((getaddrinfo(argv[1], DEST_PORT, &hints, &servinfo)) != 0) {
+    if ((getaddrinfo(argv[argc - 1], DEST_PORT, &hints, &servinfo)) != 0) {
         cerr << "client: can't get server address" << endl;
         exit(1);
     }
@@ -79,6 +278,15 @@ int main(int argc, char **argv) {
 
     freeaddrinfo(servinfo);  // Free the address info structure
 
+    // With --v2 every command goes out as a binary frame; an older server just sees text
+    if (use_v2 && !negotiateV2(sockfd)) {
+        cerr << "client: the server does not speak protocol v2" << endl;
+        exit(1);
+    }
+    uint32_t seq = 0;
+    string frames;  // v2: received bytes not yet making up a whole frame
+    string lines;   // text: received bytes not yet making up a whole line
+
     char sendline[BUF_SIZE], recvline[BUF_SIZE];
     int datalen;
 
@@ -103,27 +311,36 @@ int main(int argc, char **argv) {
         // Check if there's data from the server to read
         if (FD_ISSET(sockfd, &readfds)) {
             datalen = recv(sockfd, recvline, BUF_SIZE - 1, 0);  // Receive data from server
-            if (datalen > 0) {
-                recvline[datalen] = '\0';   // Null terminate the received message
-                std::string message(recvline);
-
-                // Check if it's an error message and handle it
-                if (message.substr(0, 3) == "ERR") {
-                    handleServerError(message);  // Decipher and print the error message
-                }
-                // If the message starts with MESG, it's a broadcast and print out the message and who it's from
-                else if(message.substr(0, 4) == "MESG") {
-                    cout << "From " << message << endl;
-                }
-                // If the message starts with PMSG, it's a private message and just print out the message
-                else if(message.substr(0, 4) == "PMSG") {
-                    cout << message << endl;  // Private message from other user
+            if (datalen > 0 && use_v2) {
+                // Print every whole frame and keep the rest for the next read
+                frames.append(recvline, datalen);
+                size_t used = 0;
+                while (frames.size() - used >= V2_HEADER_SIZE) {
+                    V2Header header = v2Decode((const unsigned char *)frames.data() + used);
+                    if (frames.size() - used < V2_HEADER_SIZE + header.length) {
+                        break;
+                    }
+                    // A frame carries the same text a line would, newline included
+                    string message = frames.substr(used + V2_HEADER_SIZE, header.length);
+                    if (!message.empty() && message[message.size() - 1] == '\n') {
+                        message.erase(message.size() - 1);
+                    }
+                    printServerMessage(message);
+                    used += V2_HEADER_SIZE + header.length;
                 }
-                // Otherwise just print ant input out
-                else{
-                    cout << message << endl;
+                frames.erase(0, used);
+            }
+            else if (datalen > 0) {
+                // Every reply ends with a newline, and one read may hold several; print every whole line and
+                // keep the rest for the next read
+                lines.append(recvline, datalen);
+                size_t used = 0;
+                size_t end;
+                while ((end = lines.find('\n', used)) != string::npos) {
+                    printServerMessage(lines.substr(used, end - used));
+                    used = end + 1;
                 }
-
+                lines.erase(0, used);
             } else if (datalen == 0) {
                 cout << "Server disconnected." << endl;
                 break;  // Server closed the connection
@@ -135,9 +352,14 @@ int main(int argc, char **argv) {
 
         // Check if the user has entered data
         if (FD_ISSET(STDIN_FILENO, &readfds)) {
-            if (cin.getline(sendline, BUF_SIZE)) {
-                // Send user input to the server
-                send(sockfd, sendline, strlen(sendline), 0);
+            if (cin.getline(sendline, BUF_SIZE) && use_v2) {
+                sendCommandFrame(sockfd, sendline, ++seq);
+            }
+            else if (cin) {
+                // Send user input to the server; the newline ends the command
+                size_t len = strlen(sendline);
+                sendline[len++] = '\n';
+                send(sockfd, sendline, len, 0);
             } else {
                 cerr << "Error reading input from user." << endl;
             }
@@ -0,0 +1,118 @@
+/*
+ * msglog.h
+ * Purpose: The on-disk format of the message log, shared by the server and msglog_dump. Relayed messages are
+ *          appended to segment files in one directory. A segment is named after the sequence number of its
+ *          first record, as 20 digits and ".log", so the directory listed in name order is the log in order.
+ *
+ *          Layout of a segment, in the byte order of the machine that wrote it:
+ *              MessageLogSegment
+ *              MessageLogRecord, then `length` bytes     repeated
+ *          The bytes after a record header are the channel (the room, or the recipient of a private message;
+ *          nothing for the public chat), then the message as it was sent. Sequence numbers run on from one
+ *          record to the next across segments. The CRC (CRC-32C) covers the record after its crc field, so a
+ *          record torn by a crash, or damaged later, is told apart from a good one.
+*/
+#ifndef CHAT_MSGLOG_H
+#define CHAT_MSGLOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#define MSGLOG_MAGIC "CHATLOG1"
+
+struct MessageLogSegment {
+    char magic[8];
+    uint64_t first_seq;             // sequence number of the first record
+};
+
+enum MessageLogKind { MSGLOG_PUBLIC = 1, MSGLOG_PRIVATE, MSGLOG_ROOM };
+
+struct MessageLogRecord {
+    uint32_t length;                // bytes after this header
+    uint32_t crc;
+    uint64_t seq;
+    int64_t time_ms;                // wall clock when the message was relayed
+    uint16_t kind;                  // MessageLogKind
+    uint8_t channel_len;
+    uint8_t reserved;
+    uint32_t reserved2;
+};
+
+static_assert(sizeof(MessageLogSegment) == 16, "message log segment layout");
+static_assert(sizeof(MessageLogRecord) == 32, "message log record layout");
+
+/*
+ * Function: msglogCrc
+ * Purpose: CRC-32C, one byte at a time from a table built on first use
+ * Parameters: The CRC so far (0 to start), the bytes, and how many there are
+*/
+static inline uint32_t msglogCrc(uint32_t crc, const void *data, size_t len) {
+    struct Table {
+        uint32_t entries[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+                }
+                entries[i] = c;
+            }
+        }
+    };
+    static const Table table;
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+ * Function: msglogRecordCrc
+ * Purpose: To work out the CRC of a record: the header after its crc field, then the bytes that follow it
+ * Parameters: The record header, and its bytes
+*/
+static inline uint32_t msglogRecordCrc(const MessageLogRecord &record, const char *body) {
+    const size_t skip = offsetof(MessageLogRecord, seq);
+    uint32_t crc = msglogCrc(0, (const char *)&record + skip, sizeof record - skip);
+    return msglogCrc(crc, body, record.length);
+}
+
+/*
+ * Function: msglogSegmentName
+ * Purpose: To name the segment that starts with the given record
+ * Parameters: The sequence number of its first record
+*/
+static inline std::string msglogSegmentName(uint64_t first_seq) {
+    char name[32];
+    snprintf(name, sizeof name, "%020llu.log", (unsigned long long)first_seq);
+    return name;
+}
+
+/*
+ * Function: msglogRecordAt
+ * Purpose: To read the record at an offset in a segment, if it is whole, has the expected sequence number,
+ *          and its CRC matches
+ * Parameters: The segment's bytes and size, the offset, the sequence number it should have, and where to
+ *             copy its header
+ * Returns: The offset just past it, or 0 if there is no good record there
+*/
+static inline size_t msglogRecordAt(const char *data, size_t size, size_t offset, uint64_t seq,
+                                    MessageLogRecord &record) {
+    if (size < offset || size - offset < sizeof record) {
+        return 0;
+    }
+    memcpy(&record, data + offset, sizeof record);
+    const char *body = data + offset + sizeof record;
+    if (size - offset - sizeof record < record.length || record.seq != seq || record.channel_len > record.length ||
+        msglogRecordCrc(record, body) != record.crc) {
+        return 0;
+    }
+    return offset + sizeof record + record.length;
+}
+
+#endif
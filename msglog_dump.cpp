@@ -0,0 +1,125 @@
+/*
+ * msglog_dump.cpp
+ * Purpose: Prints the message log the server writes with --message-log=DIR, oldest first, and checks it on
+ *          the way: every record's CRC, and that sequence numbers run on without a gap from one record and
+ *          one segment to the next. It stops at the first record that does not check out.
+ * Build: g++ -std=c++11 -O2 -o msglog_dump msglog_dump.cpp
+ * Usage: msglog_dump DIR [--from=SEQ] [--check]
+*/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "msglog.h"
+
+using namespace std;
+
+/*
+ * Function: printRecord
+ * Purpose: To print one record as "seq time kind channel: message"
+ * Parameters: The record header, and its bytes
+*/
+static void printRecord(const MessageLogRecord &record, const char *body) {
+    static const char *kinds[] = {"?", "public", "private", "room"};
+    time_t seconds = record.time_ms / 1000;
+    struct tm tm;
+    char when[32];
+    size_t n = strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &tm));
+    snprintf(when + n, sizeof when - n, ".%03d", (int)(record.time_ms % 1000));
+    cout << record.seq << " " << when << " " << kinds[record.kind <= MSGLOG_ROOM ? record.kind : 0];
+    if (record.channel_len > 0) {
+        cout << " " << string(body, record.channel_len);
+    }
+    cout << ": " << string(body + record.channel_len, record.length - record.channel_len) << "\n";
+}
+
+int main(int argc, char **argv) {
+    string dir;
+    uint64_t from = 0;
+    bool check_only = false;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--from=", 7) == 0) {
+            from = strtoull(argv[i] + 7, NULL, 10);
+        }
+        else if (strcmp(argv[i], "--check") == 0) {
+            check_only = true;
+        }
+        else if (dir.empty() && argv[i][0] != '-') {
+            dir = argv[i];
+        }
+        else {
+            dir.clear();
+            break;
+        }
+    }
+    if (dir.empty()) {
+        cerr << "Usage: msglog_dump DIR [--from=SEQ] [--check]" << endl;
+        return 1;
+    }
+
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        perror(dir.c_str());
+        return 1;
+    }
+    vector<string> segments;
+    for (struct dirent *entry = readdir(d); entry != NULL; entry = readdir(d)) {
+        string name = entry->d_name;
+        if (name.size() == 24 && name.compare(20, 4, ".log") == 0 && name.find_first_not_of("0123456789") == 20) {
+            segments.push_back(name);
+        }
+    }
+    closedir(d);
+    sort(segments.begin(), segments.end());
+
+    uint64_t expected = 0, records = 0;
+    for (size_t s = 0; s < segments.size(); s++) {
+        string path = dir + "/" + segments[s];
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(path.c_str());
+            return 1;
+        }
+        void *map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        MessageLogSegment header;
+        if (map == MAP_FAILED || (size_t)st.st_size < sizeof header) {
+            cerr << path << ": not a message log segment" << endl;
+            return 1;
+        }
+        memcpy(&header, map, sizeof header);
+        if (memcmp(header.magic, MSGLOG_MAGIC, 8) != 0 || (expected != 0 && header.first_seq != expected)) {
+            cerr << path << ": not a message log segment, or records are missing before it" << endl;
+            return 1;
+        }
+        const char *data = (const char *)map;
+        size_t offset = sizeof header;
+        MessageLogRecord record;
+        for (expected = header.first_seq; offset < (size_t)st.st_size; expected++) {
+            size_t next = msglogRecordAt(data, st.st_size, offset, expected, record);
+            if (next == 0) {
+                cerr << path << ": damaged record at offset " << offset << " (sequence number " << expected << ")" << endl;
+                return 1;
+            }
+            if (!check_only && record.seq >= from) {
+                printRecord(record, data + offset + sizeof record);
+            }
+            offset = next;
+            records++;
+        }
+        munmap(map, st.st_size);
+    }
+    cerr << records << " records in " << segments.size() << " segments, all good" << endl;
+    return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * pmsg_bench.cpp
+ * Purpose: Contention benchmark for private messages. It connects pairs of clients to a running server over
+ *          loopback, each pair on its own thread, and has every sender stream PMSGs at its partner. The run is
+ *          repeated with 1, 2, 4, ... pairs up to the number of cores, so the messages per second show how
+ *          private messages between unrelated users scale once they no longer share a lock.
+ *          Start the server with --workers=N first. Every client registers from its own 127.x.y.z address,
+ *          since the server allows one username per address.
+ * Build: g++ -std=c++11 -O2 -pthread -o pmsg_bench pmsg_bench.cpp
+ * Usage: pmsg_bench [--pairs=MAX] [--seconds=S]
+*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define DEST_PORT 12346
+// PMSGs a sender writes at once before waiting for its partner to have them all
+#define WINDOW 64
+
+using namespace std;
+
+/*
+ * Function: connectFrom
+ * Purpose: To connect to the server on loopback from the given local address
+ * Parameters: The local address
+ * Returns: The socket, or -1
+*/
+static int connectFrom(const string &local) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, local.c_str(), &addr.sin_addr);
+    if (sockfd < 0 || bind(sockfd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        perror("pmsg_bench: bind");
+        return -1;
+    }
+    addr.sin_port = htons(DEST_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        perror("pmsg_bench: connect");
+        close(sockfd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return sockfd;
+}
+
+/*
+ * Function: sendAll
+ * Purpose: To write a whole buffer to a socket
+*/
+static bool sendAll(int sockfd, const string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(sockfd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+/*
+ * Function: drain
+ * Purpose: To throw away whatever the server has sent so far (user lists, joins)
+*/
+static void drain(int sockfd) {
+    char buf[65536];
+    while (recv(sockfd, buf, sizeof buf, MSG_DONTWAIT) > 0) {
+    }
+}
+
+// One sender and its partner
+struct Pair {
+    int sender;
+    int receiver;
+    string burst;                   // WINDOW PMSGs, sent with one write
+    size_t delivered_len;           // bytes the receiver gets per PMSG
+};
+
+/*
+ * Function: runPair
+ * Purpose: To stream bursts of PMSGs through one pair until the deadline
+ * Parameters: The pair, the deadline, and where to count delivered messages
+*/
+static void runPair(Pair &pair, chrono::steady_clock::time_point deadline, atomic<uint64_t> &delivered) {
+    char buf[65536];
+    size_t expected = pair.delivered_len * WINDOW;
+    while (chrono::steady_clock::now() < deadline) {
+        if (!sendAll(pair.sender, pair.burst)) {
+            cerr << "pmsg_bench: lost the connection" << endl;
+            return;
+        }
+        size_t received = 0;
+        while (received < expected) {
+            ssize_t n = recv(pair.receiver, buf, sizeof buf, 0);
+            if (n <= 0) {
+                cerr << "pmsg_bench: lost the connection" << endl;
+                return;
+            }
+            received += n;
+        }
+        delivered += WINDOW;
+    }
+}
+
+/*
+ * Function: runStep
+ * Purpose: To register the given number of pairs, time them, and have them leave again
+ * Parameters: The number of pairs, the step (for unique names and addresses), and how long to run
+ * Returns: Messages delivered per second, or a negative number on error
+*/
+static double runStep(int pairs, int step, double seconds) {
+    vector<Pair> all(pairs);
+    for (int i = 0; i < pairs; i++) {
+        string sender_name = "s" + to_string(step) + "_" + to_string(i);
+        string receiver_name = "r" + to_string(step) + "_" + to_string(i);
+        all[i].sender = connectFrom("127.2." + to_string(step) + "." + to_string(2 * i + 1));
+        all[i].receiver = connectFrom("127.2." + to_string(step) + "." + to_string(2 * i + 2));
+        if (all[i].sender < 0 || all[i].receiver < 0 ||
+            !sendAll(all[i].sender, "REG " + sender_name + "\n") || !sendAll(all[i].receiver, "REG " + receiver_name + "\n")) {
+            return -1;
+        }
+        string text = "hello " + receiver_name;
+        for (int m = 0; m < WINDOW; m++) {
+            all[i].burst += "PMSG " + receiver_name + " " + text + "\n";
+        }
+        all[i].delivered_len = string("From " + sender_name + " (private): " + text).size();
+    }
+    // Let every registration and join notice arrive before timing
+    this_thread::sleep_for(chrono::milliseconds(300));
+    for (int i = 0; i < pairs; i++) {
+        drain(all[i].sender);
+        drain(all[i].receiver);
+    }
+
+    atomic<uint64_t> delivered(0);
+    vector<thread> threads;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    chrono::steady_clock::time_point deadline = start + chrono::milliseconds((long)(seconds * 1000));
+    for (int i = 0; i < pairs; i++) {
+        threads.push_back(thread(runPair, ref(all[i]), deadline, ref(delivered)));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    for (int i = 0; i < pairs; i++) {
+        sendAll(all[i].sender, "EXIT\n");
+        sendAll(all[i].receiver, "EXIT\n");
+        close(all[i].sender);
+        close(all[i].receiver);
+    }
+    this_thread::sleep_for(chrono::milliseconds(300));
+    return delivered.load() / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int max_pairs = thread::hardware_concurrency();
+    double seconds = 3;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--pairs=", 8) == 0) {
+            max_pairs = atoi(argv[i] + 8);
+        }
+        else if (strncmp(argv[i], "--seconds=", 10) == 0) {
+            seconds = atof(argv[i] + 10);
+        }
+        else {
+            cout << "Usage: pmsg_bench [--pairs=MAX] [--seconds=S]" << endl;
+            return 1;
+        }
+    }
+    if (max_pairs < 1 || max_pairs > 127) {
+        cerr << "pmsg_bench: --pairs must be between 1 and 127" << endl;
+        return 1;
+    }
+
+    double single = 0;
+    int step = 1;
+    for (int pairs = 1; ; pairs = min(pairs * 2, max_pairs), step++) {
+        double rate = runStep(pairs, step, seconds);
+        if (rate < 0) {
+            return 1;
+        }
+        if (pairs == 1) {
+            single = rate;
+        }
+        cout << setw(4) << pairs << " pairs " << fixed << setprecision(0) << setw(12) << rate << " PMSG/s"
+             << setprecision(2) << setw(8) << rate / single << "x" << endl;
+        if (pairs == max_pairs) {
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * proto.h
+ * Purpose: The binary wire format (protocol v2) shared by the server and the client.
+ *          A client asks for it by sending V2_PREFACE as the very first bytes of the connection; the server
+ *          answers with a V2_HELLO frame, and from then on both sides send frames. A client that starts
+ *          with anything else is a text client and keeps using newline-terminated commands.
+ *
+ *          Every frame is a fixed 12-byte header followed by `length` bytes of payload:
+ *              length (4) | opcode (1) | flags (1) | reserved (2) | seq (4)      all big-endian
+ *          The client numbers its frames; replies to a frame carry its seq and V2_FLAG_REPLY, anything
+ *          the server sends on its own (chat, joins and leaves) has seq 0.
+ *
+ *          Payloads: REG the username, MESG the text, PMSG one byte of recipient length, the recipient,
+ *          then the text, EXIT nothing, JOIN and PART the room name, RMSG one byte of room name length,
+ *          the room, then the text, HIST one byte of room name length (0 for the public chat), the room, then
+ *          optionally two bytes of message count. An empty HIST payload asks for the default count of the
+ *          public chat. RESUME is empty to ask for a token, or the 32-character token then the stream position
+ *          as 8 bytes; ACK is the position as 8 bytes. LIST is empty for the first page of the user list, or a
+ *          4-byte cursor, then optionally two bytes of page size; DELTAS is empty. Server frames carry the same
+ *          text the text protocol would send; room chat comes as V2_PUBLIC, and a history replay as one
+ *          V2_REPLY with a message per line.
+*/
+#ifndef CHAT_PROTO_H
+#define CHAT_PROTO_H
+
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+
+// First bytes of a v2 connection; the leading NUL can never start a text command
+#define V2_PREFACE      "\0CHAT/2\n"
+#define V2_PREFACE_LEN  8
+#define V2_HEADER_SIZE  12
+// Largest payload, so that a whole frame fits where the longest text command does
+#define V2_MAX_PAYLOAD  (4096 - V2_HEADER_SIZE)
+
+enum V2Opcode {
+    // Client to server
+    V2_HELLO = 1,                   // both ways: the server's answer to the preface
+    V2_REG,
+    V2_MESG,
+    V2_PMSG,
+    V2_EXIT,
+    V2_JOIN,
+    V2_PART,
+    V2_RMSG,
+    V2_HIST,
+    V2_RESUME,
+    V2_ACK,
+    V2_LIST,
+    V2_DELTAS,
+    // Server to client
+    V2_REPLY = 16,                  // user lists and notices
+    V2_ERROR,                       // "ERR n"
+    V2_PUBLIC,                      // public chat
+    V2_PRIVATE,                     // a private message
+    V2_PRESENCE                     // someone joined or left
+};
+
+// The frame answers the client frame with the same seq
+#define V2_FLAG_REPLY 0x01
+
+struct V2Header {
+    uint32_t length;
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t seq;
+};
+
+/*
+ * Function: v2Encode
+ * Purpose: To write a frame header
+ * Parameters: Where to put its V2_HEADER_SIZE bytes, and the header
+*/
+static inline void v2Encode(unsigned char *out, const V2Header &header) {
+    uint32_t length = htonl(header.length);
+    uint32_t seq = htonl(header.seq);
+    memcpy(out, &length, 4);
+    out[4] = header.opcode;
+    out[5] = header.flags;
+    out[6] = out[7] = 0;
+    memcpy(out + 8, &seq, 4);
+}
+
+/*
+ * Function: v2Put64 / v2Get64
+ * Purpose: To write and read the 8-byte big-endian numbers of RESUME and ACK
+ * Parameters: Where the bytes go (or are), and the number
+*/
+static inline void v2Put64(unsigned char *out, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        out[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static inline uint64_t v2Get64(const unsigned char *in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = value << 8 | in[i];
+    }
+    return value;
+}
+
+/*
+ * Function: v2Decode
+ * Purpose: To read a frame header
+ * Parameters: Its V2_HEADER_SIZE bytes
+*/
+static inline V2Header v2Decode(const unsigned char *in) {
+    V2Header header;
+    uint32_t length, seq;
+    memcpy(&length, in, 4);
+    memcpy(&seq, in + 8, 4);
+    header.length = ntohl(length);
+    header.opcode = in[4];
+    header.flags = in[5];
+    header.seq = ntohl(seq);
+    return header;
+}
+
+#endif
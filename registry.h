@@ -0,0 +1,258 @@
+/*
+ * registry.h
+ * Purpose: The binary snapshot of the user registry. The server maps it read-only at startup and looks users
+ *          up in it in place, so starting takes the same time whether it holds ten users or ten million.
+ *
+ *          Layout, in the byte order of the machine that wrote it:
+ *              RegistryHeader
+ *              name_slots x RegistryRecord     open-addressed hash table on the username
+ *              addr_slots x RegistryAddrSlot   open-addressed hash table on the client address
+ *              pool_size bytes                 the usernames and addresses, not NUL-terminated
+ *          Both tables are powers of two at most half full and probed linearly, so a lookup ends at the first
+ *          empty slot. The file is written whole and renamed into place, never changed where it lies.
+*/
+#ifndef CHAT_REGISTRY_H
+#define CHAT_REGISTRY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REGISTRY_MAGIC "CHATREG1"
+
+struct RegistryHeader {
+    char magic[8];
+    uint32_t count;                 // users in the snapshot
+    uint32_t name_slots;
+    uint32_t addr_slots;
+    uint32_t pool_size;
+};
+
+// One slot of the username table; name_len 0 marks an empty slot
+struct RegistryRecord {
+    uint32_t hash;
+    uint32_t name_off;
+    uint32_t addr_off;
+    uint8_t name_len;
+    uint8_t addr_len;
+    uint16_t reserved;
+};
+
+// One slot of the address table, pointing at the user's record; record 0 marks an empty slot
+struct RegistryAddrSlot {
+    uint32_t hash;
+    uint32_t record;                // slot in the username table, plus one
+};
+
+static_assert(sizeof(RegistryHeader) == 24, "registry header layout");
+static_assert(sizeof(RegistryRecord) == 16, "registry record layout");
+static_assert(sizeof(RegistryAddrSlot) == 8, "registry address slot layout");
+
+// A mapped snapshot; all pointers are NULL when there is none
+struct RegistrySnapshot {
+    void *map;
+    size_t size;
+    const RegistryHeader *header;
+    const RegistryRecord *names;
+    const RegistryAddrSlot *addrs;
+    const char *pool;
+};
+
+/*
+ * Function: registryHash
+ * Purpose: FNV-1a, to place usernames and addresses in the tables
+ * Parameters: The bytes, and how many there are
+*/
+static inline uint32_t registryHash(const char *p, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Function: registryMap
+ * Purpose: To map a snapshot file and check that its tables fit in it. Records are not read here; that would
+ *          cost time in proportion to the registry.
+ * Parameters: The open file, and the snapshot to fill in
+ * Returns: false if the file is not a usable snapshot
+*/
+static inline bool registryMap(int fd, RegistrySnapshot &snapshot) {
+    memset(&snapshot, 0, sizeof snapshot);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(RegistryHeader)) {
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    const RegistryHeader *header = (const RegistryHeader *)map;
+    uint64_t expected = sizeof(RegistryHeader) + (uint64_t)header->name_slots * sizeof(RegistryRecord) +
+                        (uint64_t)header->addr_slots * sizeof(RegistryAddrSlot) + header->pool_size;
+    if (memcmp(header->magic, REGISTRY_MAGIC, 8) != 0 || expected != (uint64_t)st.st_size ||
+        header->name_slots == 0 || (header->name_slots & (header->name_slots - 1)) != 0 ||
+        header->addr_slots == 0 || (header->addr_slots & (header->addr_slots - 1)) != 0 ||
+        header->count > header->name_slots / 2 || header->count > header->addr_slots / 2) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    snapshot.map = map;
+    snapshot.size = st.st_size;
+    snapshot.header = header;
+    snapshot.names = (const RegistryRecord *)(header + 1);
+    snapshot.addrs = (const RegistryAddrSlot *)(snapshot.names + header->name_slots);
+    snapshot.pool = (const char *)(snapshot.addrs + header->addr_slots);
+    return true;
+}
+
+/*
+ * Function: registryUnmap
+ * Purpose: To let go of a mapped snapshot
+*/
+static inline void registryUnmap(RegistrySnapshot &snapshot) {
+    if (snapshot.map != NULL) {
+        munmap(snapshot.map, snapshot.size);
+    }
+    memset(&snapshot, 0, sizeof snapshot);
+}
+
+/*
+ * Function: registryString
+ * Purpose: To read a string out of the pool, as empty if a damaged record points outside it
+ * Parameters: The snapshot, the offset, and the length
+*/
+static inline std::string registryString(const RegistrySnapshot &snapshot, uint32_t off, uint8_t len) {
+    if ((uint64_t)off + len > snapshot.header->pool_size) {
+        return std::string();
+    }
+    return std::string(snapshot.pool + off, len);
+}
+
+/*
+ * Function: registryFindName
+ * Purpose: To look a username up in the snapshot
+ * Parameters: The snapshot, and the username
+ * Returns: Its record, or NULL
+*/
+static inline const RegistryRecord *registryFindName(const RegistrySnapshot &snapshot, const std::string &name) {
+    if (snapshot.map == NULL || name.empty() || name.size() > 255) {
+        return NULL;
+    }
+    uint32_t hash = registryHash(name.data(), name.size());
+    uint32_t mask = snapshot.header->name_slots - 1;
+    // A sound table always has an empty slot; a damaged one with none is walked once around, not forever
+    uint32_t i = hash & mask;
+    for (uint32_t probes = 0; probes <= mask && snapshot.names[i].name_len != 0; probes++, i = (i + 1) & mask) {
+        const RegistryRecord &record = snapshot.names[i];
+        if (record.hash == hash && record.name_len == name.size() &&
+            (uint64_t)record.name_off + record.name_len <= snapshot.header->pool_size &&
+            memcmp(snapshot.pool + record.name_off, name.data(), name.size()) == 0) {
+            return &record;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: registryFindAddr
+ * Purpose: To look a client address up in the snapshot
+ * Parameters: The snapshot, and the address
+ * Returns: The record of the user registered from it, or NULL
+*/
+static inline const RegistryRecord *registryFindAddr(const RegistrySnapshot &snapshot, const std::string &addr) {
+    if (snapshot.map == NULL || addr.size() > 255) {
+        return NULL;
+    }
+    uint32_t hash = registryHash(addr.data(), addr.size());
+    uint32_t mask = snapshot.header->addr_slots - 1;
+    uint32_t i = hash & mask;
+    for (uint32_t probes = 0; probes <= mask && snapshot.addrs[i].record != 0; probes++, i = (i + 1) & mask) {
+        const RegistryAddrSlot &slot = snapshot.addrs[i];
+        if (slot.hash != hash || slot.record > snapshot.header->name_slots) {
+            continue;
+        }
+        const RegistryRecord &record = snapshot.names[slot.record - 1];
+        if (record.addr_len == addr.size() && (uint64_t)record.addr_off + record.addr_len <= snapshot.header->pool_size &&
+            memcmp(snapshot.pool + record.addr_off, addr.data(), addr.size()) == 0) {
+            return &record;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: registryBuild
+ * Purpose: To lay out a snapshot of the given users
+ * Parameters: The users as (username, address) pairs, each username once
+ * Returns: The whole file
+*/
+static inline std::string registryBuild(const std::vector<std::pair<std::string, std::string> > &users) {
+    uint32_t name_slots = 16;
+    while (name_slots < users.size() * 2) {
+        name_slots *= 2;
+    }
+    uint32_t addr_slots = name_slots;
+    std::vector<RegistryRecord> names(name_slots);
+    std::vector<RegistryAddrSlot> addrs(addr_slots);
+    memset(names.data(), 0, name_slots * sizeof(RegistryRecord));
+    memset(addrs.data(), 0, addr_slots * sizeof(RegistryAddrSlot));
+    std::string pool;
+
+    uint32_t count = 0;
+    for (size_t u = 0; u < users.size(); u++) {
+        const std::string &name = users[u].first;
+        const std::string &addr = users[u].second;
+        if (name.empty() || name.size() > 255 || addr.size() > 255) {
+            continue;
+        }
+        RegistryRecord record;
+        record.hash = registryHash(name.data(), name.size());
+        record.name_off = pool.size();
+        record.name_len = name.size();
+        pool += name;
+        record.addr_off = pool.size();
+        record.addr_len = addr.size();
+        pool += addr;
+        record.reserved = 0;
+
+        uint32_t i = record.hash & (name_slots - 1);
+        while (names[i].name_len != 0) {
+            i = (i + 1) & (name_slots - 1);
+        }
+        names[i] = record;
+
+        RegistryAddrSlot slot;
+        slot.hash = registryHash(addr.data(), addr.size());
+        slot.record = i + 1;
+        uint32_t j = slot.hash & (addr_slots - 1);
+        while (addrs[j].record != 0) {
+            j = (j + 1) & (addr_slots - 1);
+        }
+        addrs[j] = slot;
+        count++;
+    }
+
+    RegistryHeader header;
+    memcpy(header.magic, REGISTRY_MAGIC, 8);
+    header.count = count;
+    header.name_slots = name_slots;
+    header.addr_slots = addr_slots;
+    header.pool_size = pool.size();
+
+    std::string file;
+    file.reserve(sizeof header + name_slots * sizeof(RegistryRecord) + addr_slots * sizeof(RegistryAddrSlot) + pool.size());
+    file.append((const char *)&header, sizeof header);
+    file.append((const char *)names.data(), name_slots * sizeof(RegistryRecord));
+    file.append((const char *)addrs.data(), addr_slots * sizeof(RegistryAddrSlot));
+    file += pool;
+    return file;
+}
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ * scan.h
+ * Purpose: Vectorized scanning of the chat server's text protocol. One pass over a command's bytes finds
+ *          the newline that ends it, the spaces around its argument, and everything registration needs to
+ *          validate a username. AVX2 is used when the CPU has it, SSE2 otherwise, and plain loops on
+ *          anything that is not x86.
+*/
+#ifndef CHAT_SCAN_H
+#define CHAT_SCAN_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+// Longest username registration accepts
+#define MAX_USERNAME 32
+
+// Commands of the text protocol
+enum Command { CMD_NONE, CMD_REG, CMD_MESG, CMD_PMSG, CMD_EXIT, CMD_JOIN, CMD_PART, CMD_RMSG, CMD_HIST, CMD_RESUME, CMD_ACK,
+               CMD_LIST, CMD_DELTAS, CMD_UNKNOWN };
+
+// Username checks, in the order registration reports them
+enum UsernameCheck { USERNAME_OK, USERNAME_EMPTY, USERNAME_TOO_LONG, USERNAME_HAS_SPACE };
+
+// What one pass over a run of bytes finds; positions are relative to its start
+struct Span {
+    size_t first;                   // first byte that is not a space (the length if there is none)
+    size_t last;                    // one past the last byte that is not a space
+    size_t space;                   // first space after `first` (the length if there is none)
+};
+
+// A command line taken apart
+struct CommandScan {
+    Command cmd;
+    const char *arg;                // the argument without the spaces around it
+    size_t arg_len;
+    size_t arg_space;               // first space inside the argument (arg_len if there is none)
+};
+
+/*
+ * Function: spanBlock
+ * Purpose: To fold the space mask of one 16- or 32-byte block into a span
+ * Parameters: The span, the length of the run, the block's offset, its space bits, and its other bits
+*/
+static inline void spanBlock(Span &span, size_t len, size_t base, uint32_t spaces, uint32_t others) {
+    if (span.first == len) {
+        if (others == 0) {
+            return;
+        }
+        int first = __builtin_ctz(others);
+        span.first = base + first;
+        // Spaces before the first word are leading spaces, not separators
+        spaces &= ~0u << first;
+    }
+    if (span.space == len && spaces != 0) {
+        span.space = base + __builtin_ctz(spaces);
+    }
+    if (others != 0) {
+        span.last = base + 32 - __builtin_clz(others);
+    }
+}
+
+/*
+ * Function: spanTail
+ * Purpose: To finish a span one byte at a time, for the bytes after the last whole block
+ * Parameters: The span, the run, its length, and where the blocks stopped
+*/
+static inline void spanTail(Span &span, const char *p, size_t len, size_t i) {
+    for ( ; i < len; i++) {
+        if (p[i] != ' ') {
+            if (span.first == len) {
+                span.first = i;
+            }
+            span.last = i + 1;
+        }
+        else if (span.first != len && span.space == len) {
+            span.space = i;
+        }
+    }
+}
+
+/*
+ * Function: scanSpanScalar
+ * Purpose: To find the words in a run of bytes one byte at a time (also the reference for the vector versions)
+ * Parameters: The bytes, and how many there are
+*/
+static inline Span scanSpanScalar(const char *p, size_t len) {
+    Span span = {len, 0, len};
+    spanTail(span, p, len, 0);
+    return span;
+}
+
+/*
+ * Function: findNewlineScalar
+ * Purpose: To find the first newline one byte at a time
+ * Parameters: The bytes, and how many there are
+ * Returns: Its position, or the length if there is none
+*/
+static inline size_t findNewlineScalar(const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && p[i] != '\n') {
+        i++;
+    }
+    return i;
+}
+
+#ifdef SCAN_X86
+/*
+ * Function: scanSpanSse2
+ * Purpose: scanSpanScalar, 16 bytes at a time. SSE2 is part of every x86-64 CPU, so this needs no check.
+*/
+static inline Span scanSpanSse2(const char *p, size_t len) {
+    Span span = {len, 0, len};
+    const __m128i space = _mm_set1_epi8(' ');
+    size_t i = 0;
+    for ( ; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        uint32_t spaces = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, space));
+        spanBlock(span, len, i, spaces, ~spaces & 0xffff);
+    }
+    spanTail(span, p, len, i);
+    return span;
+}
+
+/*
+ * Function: findNewlineSse2
+ * Purpose: findNewlineScalar, 16 bytes at a time
+*/
+static inline size_t findNewlineSse2(const char *p, size_t len) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for ( ; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        uint32_t hits = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        if (hits != 0) {
+            return i + __builtin_ctz(hits);
+        }
+    }
+    return i + findNewlineScalar(p + i, len - i);
+}
+
+/*
+ * Function: scanSpanAvx2
+ * Purpose: scanSpanScalar, 32 bytes at a time. A whole username fits in one block.
+*/
+__attribute__((target("avx2")))
+static Span scanSpanAvx2(const char *p, size_t len) {
+    Span span = {len, 0, len};
+    const __m256i space = _mm256_set1_epi8(' ');
+    size_t i = 0;
+    for ( ; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        uint32_t spaces = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, space));
+        spanBlock(span, len, i, spaces, ~spaces);
+    }
+    if (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        uint32_t spaces = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        spanBlock(span, len, i, spaces, ~spaces & 0xffff);
+        i += 16;
+    }
+    spanTail(span, p, len, i);
+    return span;
+}
+
+/*
+ * Function: findNewlineAvx2
+ * Purpose: findNewlineScalar, 32 bytes at a time
+*/
+__attribute__((target("avx2")))
+static size_t findNewlineAvx2(const char *p, size_t len) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for ( ; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        uint32_t hits = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        if (hits != 0) {
+            return i + __builtin_ctz(hits);
+        }
+    }
+    return i + findNewlineSse2(p + i, len - i);
+}
+#endif
+
+/*
+ * Function: scanHaveAvx2
+ * Purpose: To check once whether this CPU runs the AVX2 versions
+*/
+static inline bool scanHaveAvx2() {
+#ifdef SCAN_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Function: scanSpan
+ * Purpose: To find the first word, the first space after it, and the end of the last word in a run of bytes
+ * Parameters: The bytes, and how many there are
+*/
+static inline Span scanSpan(const char *p, size_t len) {
+#ifdef SCAN_X86
+    return scanHaveAvx2() ? scanSpanAvx2(p, len) : scanSpanSse2(p, len);
+#else
+    return scanSpanScalar(p, len);
+#endif
+}
+
+/*
+ * Function: findNewline
+ * Purpose: To find the newline that ends a command
+ * Parameters: The bytes, and how many there are
+ * Returns: Its position, or the length if there is none
+*/
+static inline size_t findNewline(const char *p, size_t len) {
+#ifdef SCAN_X86
+    return scanHaveAvx2() ? findNewlineAvx2(p, len) : findNewlineSse2(p, len);
+#else
+    return findNewlineScalar(p, len);
+#endif
+}
+
+/*
+ * Function: scanCommandWith
+ * Purpose: To take a command line apart with the given span scanner. The command word is matched on the raw
+ *          line with one 32-bit compare, then only the rest of the line is scanned, so every byte is looked at once.
+ * Parameters: The span scanner, the line (without its newline), and its length
+*/
+static inline CommandScan scanCommandWith(Span (*scan)(const char *, size_t), const char *line, size_t len) {
+    CommandScan result = {CMD_UNKNOWN, line, 0, 0};
+    size_t skip = 0;
+    if (len >= 4) {
+        uint32_t word;
+        memcpy(&word, line, 4);
+        if (memcmp(&word, "REG ", 4) == 0) {
+            result.cmd = CMD_REG;
+            skip = 4;
+        }
+        else if (len >= 5 && line[4] == ' ' && memcmp(&word, "MESG", 4) == 0) {
+            result.cmd = CMD_MESG;
+            skip = 5;
+        }
+        else if (len >= 5 && line[4] == ' ' && memcmp(&word, "PMSG", 4) == 0) {
+            result.cmd = CMD_PMSG;
+            skip = 5;
+        }
+        else if (len >= 5 && line[4] == ' ' && memcmp(&word, "JOIN", 4) == 0) {
+            result.cmd = CMD_JOIN;
+            skip = 5;
+        }
+        else if (len >= 5 && line[4] == ' ' && memcmp(&word, "PART", 4) == 0) {
+            result.cmd = CMD_PART;
+            skip = 5;
+        }
+        else if (len >= 5 && line[4] == ' ' && memcmp(&word, "RMSG", 4) == 0) {
+            result.cmd = CMD_RMSG;
+            skip = 5;
+        }
+        // HIST may come without an argument
+        else if ((len == 4 || line[4] == ' ') && memcmp(&word, "HIST", 4) == 0) {
+            result.cmd = CMD_HIST;
+            skip = std::min<size_t>(len, 5);
+        }
+        // So may RESUME
+        else if (len >= 6 && (len == 6 || line[6] == ' ') && memcmp(line, "RESUME", 6) == 0) {
+            result.cmd = CMD_RESUME;
+            skip = std::min<size_t>(len, 7);
+        }
+        else if (memcmp(&word, "ACK ", 4) == 0) {
+            result.cmd = CMD_ACK;
+            skip = 4;
+        }
+        // LIST and DELTAS may too (DELTAS takes no argument at all)
+        else if ((len == 4 || line[4] == ' ') && memcmp(&word, "LIST", 4) == 0) {
+            result.cmd = CMD_LIST;
+            skip = std::min<size_t>(len, 5);
+        }
+        else if (len >= 6 && (len == 6 || line[6] == ' ') && memcmp(line, "DELTAS", 6) == 0) {
+            result.cmd = CMD_DELTAS;
+            skip = std::min<size_t>(len, 7);
+        }
+    }
+
+    Span span = scan(line + skip, len - skip);
+    if (span.first == len - skip) {
+        // Nothing but spaces after the command word (or at all)
+        result.arg = line + len;
+        result.cmd = skip == 0 ? CMD_NONE : result.cmd;
+        return result;
+    }
+    result.arg = line + skip + span.first;
+    result.arg_len = span.last - span.first;
+    result.arg_space = std::min(span.space, span.last) - span.first;
+    if (skip == 0 && result.arg_len == 4 && memcmp(result.arg, "EXIT", 4) == 0) {
+        result.cmd = CMD_EXIT;
+    }
+    return result;
+}
+
+/*
+ * Function: scanCommand
+ * Purpose: To take a command line apart with the fastest scanner this CPU has
+ * Parameters: The line (without its newline), and its length
+*/
+static inline CommandScan scanCommand(const char *line, size_t len) {
+    return scanCommandWith(scanSpan, line, len);
+}
+
+/*
+ * Function: checkUsername
+ * Purpose: To validate the argument of REG from what the scan already found. Room names for JOIN and PART
+ *          follow the same rules.
+ * Parameters: The scanned REG (or JOIN or PART) command
+*/
+static inline UsernameCheck checkUsername(const CommandScan &scan) {
+    if (scan.arg_len == 0) {
+        return USERNAME_EMPTY;
+    }
+    if (scan.arg_len > MAX_USERNAME) {
+        return USERNAME_TOO_LONG;
+    }
+    if (scan.arg_space < scan.arg_len) {
+        return USERNAME_HAS_SPACE;
+    }
+    return USERNAME_OK;
+}
+
+/*
+ * Function: splitPrivate
+ * Purpose: To split the argument of PMSG into the recipient and the message (or of RMSG into the room and the message)
+ * Parameters: The scanned PMSG or RMSG command, and where to put the message's start and length
+ * Returns: false if there is no message after the recipient
+*/
+static inline bool splitPrivate(const CommandScan &scan, const char *&text, size_t &text_len) {
+    if (scan.arg_space >= scan.arg_len) {
+        return false;
+    }
+    size_t start = scan.arg_space + 1;
+    while (start < scan.arg_len && scan.arg[start] == ' ') {
+        start++;
+    }
+    text = scan.arg + start;
+    text_len = scan.arg_len - start;
+    return true;
+}
+
+#endif
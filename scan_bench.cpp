@@ -0,0 +1,267 @@
+/*
+ * scan_bench.cpp
+ * Purpose: Microbenchmark for the command scanner in scan.h. It checks that every scanner agrees with the
+ *          trim()/strncmp() parsing the server used before, then times both on a mix of chat commands.
+ * Build: g++ -std=c++11 -O2 -o scan_bench scan_bench.cpp
+*/
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include "scan.h"
+
+using namespace std;
+
+// Rounds over the corpus per measurement
+#define ROUNDS 200
+
+// How a line was understood, in a form both parsers can produce
+struct Parsed {
+    Command cmd;
+    int check;                      // UsernameCheck for REG, 1 for a PMSG without a message
+    string first;                   // username, message, or recipient
+    string second;                  // private message text
+};
+
+/*
+ * Function: trim
+ * Purpose: The server's former trim(), kept as the baseline
+*/
+static string trim(const string& str) {
+    size_t first = str.find_first_not_of(' ');
+    if (first == string::npos)
+        return "";
+    size_t last = str.find_last_not_of(' ');
+    return str.substr(first, last - first + 1);
+}
+
+/*
+ * Function: parseBaseline
+ * Purpose: To parse a line the way handleMessage() and registration() did before the scanner
+ * Parameters: The null-terminated line
+*/
+static Parsed parseBaseline(const char *mesg) {
+    Parsed p = {CMD_UNKNOWN, 0, string(), string()};
+    string trimmed_message = trim(mesg);
+    if (trimmed_message.empty()) {
+        p.cmd = CMD_NONE;
+    }
+    else if (strncmp(mesg, "REG ", 4) == 0) {
+        p.cmd = CMD_REG;
+        p.first = trim(mesg + 4);
+        if (p.first.empty()) {
+            p.check = USERNAME_EMPTY;
+        }
+        else if (p.first.length() > 32) {
+            p.check = USERNAME_TOO_LONG;
+        }
+        else if (p.first.find(' ') != string::npos) {
+            p.check = USERNAME_HAS_SPACE;
+        }
+    }
+    else if (strncmp(mesg, "MESG ", 5) == 0) {
+        p.cmd = CMD_MESG;
+        p.first = trim(mesg + 5);
+    }
+    else if (strncmp(mesg, "PMSG ", 5) == 0) {
+        p.cmd = CMD_PMSG;
+        string rest_of_message = trim(mesg + 5);
+        size_t space_pos = rest_of_message.find(' ');
+        if (space_pos == string::npos) {
+            p.check = 1;
+        }
+        else {
+            p.first = rest_of_message.substr(0, space_pos);
+            p.second = trim(rest_of_message.substr(space_pos + 1));
+        }
+    }
+    else if (trimmed_message == "EXIT") {
+        p.cmd = CMD_EXIT;
+    }
+    return p;
+}
+
+/*
+ * Function: parseScanned
+ * Purpose: To turn a scan into the same form as parseBaseline(), for the correctness check
+ * Parameters: The scan
+*/
+static Parsed parseScanned(const CommandScan &scan) {
+    Parsed p = {scan.cmd, 0, string(), string()};
+    if (scan.cmd == CMD_REG) {
+        p.check = checkUsername(scan);
+        p.first.assign(scan.arg, scan.arg_len);
+        if (p.check == USERNAME_EMPTY) {
+            p.first.clear();
+        }
+    }
+    else if (scan.cmd == CMD_MESG) {
+        p.first.assign(scan.arg, scan.arg_len);
+    }
+    else if (scan.cmd == CMD_PMSG) {
+        const char *text;
+        size_t text_len;
+        if (!splitPrivate(scan, text, text_len)) {
+            p.check = 1;
+        }
+        else {
+            p.first.assign(scan.arg, scan.arg_space);
+            p.second.assign(text, text_len);
+        }
+    }
+    return p;
+}
+
+/*
+ * Function: randomLine
+ * Purpose: To make a command line with random spacing, for the correctness check
+*/
+static string randomLine() {
+    static const char *words[] = {"REG", "MESG", "PMSG", "EXIT", "REG ", "PMSG  ", "MESGX", "", "EXITS", "bob"};
+    string line(rand() % 3 == 0 ? rand() % 4 : 0, ' ');
+    line += words[rand() % 10];
+    int parts = rand() % 5;
+    for (int i = 0; i < parts; i++) {
+        line += string(rand() % 3, ' ');
+        line += string(rand() % 50, "abcxyz"[rand() % 6]);
+    }
+    line += string(rand() % 3 == 0 ? rand() % 40 : 0, ' ');
+    return line;
+}
+
+/*
+ * Function: sameParse
+ * Purpose: To compare the results of two parsers
+*/
+static bool sameParse(const Parsed &a, const Parsed &b) {
+    return a.cmd == b.cmd && a.check == b.check && a.first == b.first && a.second == b.second;
+}
+
+/*
+ * Function: makeCorpus
+ * Purpose: To build the timed mix of commands, weighted towards chat the way a busy server sees it
+*/
+static vector<string> makeCorpus() {
+    vector<string> corpus;
+    srand(7);
+    for (int i = 0; i < 10000; i++) {
+        int kind = rand() % 10;
+        string text(10 + rand() % 150, 'm');
+        for (size_t j = 0; j < text.size(); j += 6) {
+            text[j] = ' ';
+        }
+        if (kind < 6) {
+            corpus.push_back("MESG " + text);
+        }
+        else if (kind < 9) {
+            corpus.push_back("PMSG user" + to_string(rand() % 1000) + " " + text);
+        }
+        else {
+            corpus.push_back("REG user" + to_string(rand() % 100000));
+        }
+    }
+    return corpus;
+}
+
+/*
+ * Function: report
+ * Purpose: To print one timing line
+*/
+static void report(const char *name, double seconds, size_t lines, size_t bytes, size_t checksum) {
+    cout << left << setw(22) << name << right << fixed << setprecision(1)
+         << setw(10) << seconds * 1e9 / lines << " ns/line"
+         << setw(10) << bytes / seconds / 1e6 << " MB/s"
+         << "   (checksum " << checksum << ")" << endl;
+}
+
+int main() {
+    // Every scanner has to agree with the old parser before its timing means anything
+    srand(1);
+    for (int i = 0; i < 200000; i++) {
+        string line = randomLine();
+        Parsed expected = parseBaseline(line.c_str());
+        Span (*scanners[])(const char *, size_t) = {
+            scanSpanScalar,
+#ifdef SCAN_X86
+            scanSpanSse2, scanHaveAvx2() ? scanSpanAvx2 : NULL,
+#endif
+        };
+        for (size_t s = 0; s < sizeof scanners / sizeof scanners[0]; s++) {
+            if (scanners[s] != NULL && !sameParse(expected, parseScanned(scanCommandWith(scanners[s], line.data(), line.size())))) {
+                cerr << "scan_bench: scanner " << s << " disagrees on \"" << line << "\"" << endl;
+                return 1;
+            }
+        }
+        line.insert(rand() % (line.size() + 1), 1, '\n');
+        if (findNewline(line.data(), line.size()) != line.find('\n')) {
+            cerr << "scan_bench: findNewline disagrees on \"" << line << "\"" << endl;
+            return 1;
+        }
+    }
+
+    vector<string> corpus = makeCorpus();
+    size_t bytes = 0;
+    for (size_t i = 0; i < corpus.size(); i++) {
+        bytes += corpus[i].size();
+    }
+    size_t lines = corpus.size() * ROUNDS;
+    bytes *= ROUNDS;
+    cout << "scanning " << corpus.size() << " commands x " << ROUNDS << " rounds, AVX2 "
+         << (scanHaveAvx2() ? "available" : "not available") << endl;
+
+    {
+        size_t checksum = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (size_t i = 0; i < corpus.size(); i++) {
+                Parsed p = parseBaseline(corpus[i].c_str());
+                checksum += p.cmd + p.check + p.first.size() + p.second.size();
+            }
+        }
+        report("trim/strncmp", chrono::duration<double>(chrono::steady_clock::now() - start).count(), lines, bytes, checksum);
+    }
+
+    struct { const char *name; Span (*scan)(const char *, size_t); } scanners[] = {
+        {"scanner (scalar)", scanSpanScalar},
+#ifdef SCAN_X86
+        {"scanner (SSE2)", scanSpanSse2},
+        {"scanner (AVX2)", scanHaveAvx2() ? scanSpanAvx2 : NULL},
+#endif
+    };
+    for (size_t s = 0; s < sizeof scanners / sizeof scanners[0]; s++) {
+        if (scanners[s].scan == NULL) {
+            continue;
+        }
+        size_t checksum = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (size_t i = 0; i < corpus.size(); i++) {
+                CommandScan scan = scanCommandWith(scanners[s].scan, corpus[i].data(), corpus[i].size());
+                size_t first = 0, second = 0;
+                int check = 0;
+                const char *text;
+                if (scan.cmd == CMD_REG) {
+                    check = checkUsername(scan);
+                    first = check == USERNAME_EMPTY ? 0 : scan.arg_len;
+                }
+                else if (scan.cmd == CMD_MESG) {
+                    first = scan.arg_len;
+                }
+                else if (scan.cmd == CMD_PMSG) {
+                    if (splitPrivate(scan, text, second)) {
+                        first = scan.arg_space;
+                    }
+                    else {
+                        check = 1;
+                    }
+                }
+                checksum += scan.cmd + check + first + second;
+            }
+        }
+        report(scanners[s].name, chrono::duration<double>(chrono::steady_clock::now() - start).count(), lines, bytes, checksum);
+    }
+    return 0;
+}
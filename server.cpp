@@ -1,48 +1,462 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <dirent.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <cerrno>
 #include <cstring>
+#include <cstdint>
 #include <fstream>
 #include <sstream>
 #include <arpa/inet.h>
-#include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <vector>
+#include <deque>
+#include <memory>
 #include <algorithm>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include "scan.h"
+#include "proto.h"
+#include "registry.h"
+#include "msglog.h"
 
 // Port, Buffer Size, and Maximum Pending connections in the server queue
 #define MY_PORT   "12346" /* arbitrary, but client and server must agree */
 #define BUF_SIZE  4096
-#define MAX_PENDING 5
+#define MAX_PENDING SOMAXCONN
+// Maximum number of readiness events handled per epoll_wait() call
+#define MAX_EVENTS 1024
+// Most queued replies gathered into one sendmsg() call
+#define FLUSH_IOVECS 256
+// Replies up to this size are copied into the client's batch buffer instead of taking an iovec of their own
+#define BATCH_SMALL_REPLY 512
+// Largest batch buffer before a new one is started
+#define BATCH_BUFFER_MAX  65536
+// Longest command line accepted, newline included
+#define MAX_LINE  BUF_SIZE
+// Per-client receive ring; a power of two with room for a partial line plus a full read
+#define IN_RING_SIZE (2 * BUF_SIZE)
+// Where the registry is kept: a binary snapshot (see registry.h), and a log of the changes made since it was written
+#define REGISTRY_SNAPSHOT "REGISTERED_USERS.snap"
+#define REGISTRY_LOG      "REGISTERED_USERS.log"
+// The text file earlier versions kept the registry in, read once if there is no snapshot yet
+#define REGISTRY_LEGACY   "REGISTERED_USERS"
+// The log is folded back into the snapshot once it holds this many records. This bounds what a restart has to
+// replay, whatever the size of the registry.
+#define REGISTRY_COMPACT_RECORDS 65536
+// Number of lock stripes in the registry and the room table
+#define REGISTRY_SHARDS 64
+// Most rooms one client may be in at once
+#define MAX_USER_ROOMS 64
+// Segments of the message log are closed once they reach this size
+#define MESSAGE_LOG_SEGMENT_BYTES (64 * 1024 * 1024)
+// The spill file of the offline mailboxes, its size, and the size of its blocks
+#define OFFLINE_SPILL_FILE  "OFFLINE_MAILBOXES.spill"
+#define OFFLINE_SPILL_BYTES (1024LL * 1024 * 1024)
+#define OFFLINE_BLOCK       256
+// Most private messages kept for one user
+#define OFFLINE_MAX_MESSAGES 1000
+// The message log commits at most once per this many microseconds; records arriving meanwhile join the next commit
+#define MESSAGE_LOG_COMMIT_US     1000
+// Most bytes of messages one event loop leaves for the log writer; more are dropped from the log (not the chat)
+#define MESSAGE_LOG_PENDING_MAX   (64 * 1024 * 1024)
+// History kept of the public chat, and of each room: bytes of text and number of messages
+#define HISTORY_BYTES         (256 * 1024)
+#define HISTORY_MESSAGES      1024
+#define HISTORY_ROOM_BYTES    (16 * 1024)
+#define HISTORY_ROOM_MESSAGES 64
+// Messages HIST replays when it is not given a number
+#define HISTORY_DEFAULT       20
+// Names on a page of LIST when it is not given a size, and the most it sends on one
+#define LIST_PAGE             500
+#define LIST_PAGE_MAX         4096
 
 using namespace std;
-// Declare global variables and mutexes to prevent concurrency
-std::mutex reg_users_mutex;
-//Storing the socket descriptors of currently connected clients
-std::vector<int> connected_clients;
-// Stores client usernames
-std::vector<std::string> usernames;
-// Mapping for associating usernames with their socket descriptors
-std::map<int, std::string> client_usernames;
+// Who is in the chat, for broadcasts and the user list. Every registered user has a dense ID, the index of its
+// slot in the roster. A join fills a free slot and a leave empties one, in place and in constant time, and
+// broadcasts walk the slots without taking any lock. A slot is only written while it is empty, and an emptied
+// slot is only handed out again once no event loop can still be reading it (see rosterReserve()), so a reader
+// that finds a slot in use can read the rest of it as it is.
+struct RosterEntry {
+    std::atomic<int> sockfd;        // -1 while the slot is empty
+    unsigned generation;            // the session the descriptor belonged to when it registered
+    bool deltas;                    // sent DELTAS: gets joins and leaves as "+name" and "-name"
+};
+// A username, stored once when its user registers and read in place from then on
+struct RosterName {
+    unsigned char len;
+    char text[MAX_USERNAME];
+};
+// Slots come a chunk at a time and are never moved or freed, so an ID stays a plain index
+#define ROSTER_CHUNK_SLOTS 1024
+#define ROSTER_CHUNKS      16384
+struct RosterChunk {
+    RosterEntry entries[ROSTER_CHUNK_SLOTS];
+    RosterName names[ROSTER_CHUNK_SLOTS];
+};
+RosterChunk *roster_chunks[ROSTER_CHUNKS];
+// Slots handed out so far; readers look at the IDs below this
+std::atomic<uint32_t> roster_size(0);
+// The ID of a client that has not registered
+#define NO_USER UINT32_MAX
+// Serializes handing out and taking back IDs, and guards the lists below
+std::mutex roster_mutex;
+// Emptied slots ready to be reused, and those still waiting for the epoch they were emptied in to pass
+std::vector<uint32_t> roster_free;
+std::vector<std::pair<uint32_t, uint64_t> > roster_retired;
+// Counts leaves; every event loop records the value it last saw in Reactor::roster_seen
+std::atomic<uint64_t> roster_epoch(0);
+// roster_seen of a loop that is waiting for events and reading nothing
+#define ROSTER_OFFLINE UINT64_MAX
+// Counts joins and leaves, so a formatted user list can tell whether it is still current
+std::atomic<uint64_t> roster_version(0);
+// Users online, for the head of a LIST page
+std::atomic<uint32_t> roster_online(0);
+
+// Recent messages of one channel, kept as the text that was sent, each followed by a newline. The text lives
+// in a byte ring allocated up front; a message never wraps around its end, so the last n messages are at most
+// two runs of bytes, and a replay copies them out as they are. The replay last built is kept, so everyone who
+// joins before the next message shares it.
+struct HistoryRecord {
+    uint32_t offset;
+    uint32_t length;
+};
+struct HistoryRing {
+    std::mutex mutex;
+    std::vector<char> bytes;
+    std::vector<HistoryRecord> records;
+    uint64_t first = 0;             // number of the oldest message kept
+    uint64_t next = 0;              // number the next message gets
+    size_t write_pos = 0;
+    std::shared_ptr<const std::string> replay;
+    size_t replay_count = 0;
+    uint64_t replay_next = 0;       // `next` when the replay was built
+};
+HistoryRing public_history;
+
+// Chat rooms. A room's members are an immutable list, replaced as a whole on every JOIN and PART, so a room
+// message reads it without taking any lock and only ever visits the room's own members. Rooms are small, so
+// the copy is cheap. Replaced lists, and rooms whose last member left, are freed once no event loop can still
+// be reading them, like roster slots.
+struct RoomMember {
+    uint32_t id;                    // the member's roster ID
+    int sockfd;
+    unsigned generation;
+};
+typedef std::vector<RoomMember> RoomMembers;
+struct Room {
+    std::string name;
+    std::atomic<const RoomMembers *> members;
+    // The same list, owned; guarded by the shard. A broadcast handed to other event loops holds a reference.
+    std::shared_ptr<const RoomMembers> members_held;
+    HistoryRing history;
+};
+// Rooms by name, split into shards by hash like the registry; JOIN and PART hold the room's shard
+struct alignas(64) RoomShard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Room *> rooms;
+};
+RoomShard room_shards[REGISTRY_SHARDS];
+// Replaced member lists (and emptied rooms) with the roster epoch they were retired in
+struct RetiredRoom {
+    std::shared_ptr<const RoomMembers> members;
+    Room *room;
+    uint64_t epoch;
+};
+std::mutex room_retired_mutex;
+std::vector<RetiredRoom> room_retired;
+
+// The registry as of the last snapshot, mapped read-only. Only the writer thread replaces it, with every shard held.
+RegistrySnapshot registry_base;
+// Users registered since the snapshot, and everyone connected; the files only keep the registry across restarts
+struct Registration {
+    std::string addr;               // the client address registered from
+    int sockfd;                     // -1 for users left over from an earlier run, and those away
+    uint64_t away_until;            // a dropped client's name is held for it until then (event loop clock); 0 otherwise
+};
+// A private message kept for a registered user who is not connected: in memory while the budget lasts, after
+// that in blocks of the spill file
+struct OfflineMessage {
+    std::shared_ptr<const std::string> text;    // NULL when spilled
+    uint32_t length;
+    std::vector<uint32_t> blocks;
+};
+// The registry is split into shards with a lock each, so registrations and private messages for different
+// users do not wait on each other. Usernames and addresses are placed by hash; one registration holds the
+// shard of its name and the shard of its address.
+struct alignas(64) RegistryShard {
+    std::mutex mutex;
+    // Username to where it is registered
+    std::unordered_map<std::string, Registration> by_name;
+    // Client address to the username registered from it
+    std::unordered_map<std::string, std::string> by_addr;
+    // Users in the snapshot who have left since it was written, and their addresses
+    std::unordered_set<std::string> shadowed;
+    std::unordered_set<std::string> shadowed_addrs;
+    // Private messages waiting for users of this shard to come back
+    std::unordered_map<std::string, std::deque<OfflineMessage> > offline;
+};
+RegistryShard registry_shards[REGISTRY_SHARDS];
+
+// Offline mailboxes: how long a dropped client's name is held (0 to forget it at once, and keep no mailboxes),
+// and how many bytes of waiting messages stay in memory before they go to the spill file
+uint64_t offline_hold_ms = 0;
+size_t offline_memory_budget = 64 * 1024 * 1024;
+std::atomic<size_t> offline_memory_used(0);
+// The spill file, mapped whole; unlinked as soon as it is open, so it is scratch space that never outlives the server
+char *offline_spill = NULL;
+std::mutex offline_spill_mutex;
+std::vector<uint32_t> offline_spill_free;
+uint32_t offline_spill_top = 0;     // blocks below this have been used at some point
+// Names held for dropped clients, in the order their holds run out
+std::mutex offline_away_mutex;
+std::deque<std::pair<uint64_t, std::string> > offline_away;
+// Messages kept, of those how many spilled, messages delivered on reconnect, and messages turned away
+std::atomic<uint64_t> offline_stored(0);
+std::atomic<uint64_t> offline_spilled(0);
+std::atomic<uint64_t> offline_delivered(0);
+std::atomic<uint64_t> offline_refused(0);
+// Registry records waiting for the writer thread, added to in the same critical section as the change they record
+std::mutex registry_log_mutex;
+std::condition_variable registry_log_ready;
+std::string registry_log_pending;
+size_t registry_log_pending_records = 0;
+// The open log, and how many records it holds (writer thread only)
+int registry_log_fd = -1;
+size_t registry_log_records = 0;
+// How many group commits and compactions the writer has done
+std::atomic<uint64_t> registry_commits(0);
+std::atomic<uint64_t> registry_compactions(0);
+
+// The message log (see msglog.h), kept in this directory; empty when there is none
+std::string message_log_dir;
+// The segment being written, how much of it is used, and the next sequence number (writer thread only)
+int message_log_fd = -1;
+size_t message_log_segment_size = 0;
+uint64_t message_log_next_seq = 1;
+// The writer sleeps with message_log_idle set; the first event loop to leave it a message clears it and wakes it
+std::mutex message_log_wake_mutex;
+std::condition_variable message_log_wake;
+std::atomic<bool> message_log_idle(false);
+// Group commits and records written, and records left out because the writer fell too far behind
+std::atomic<uint64_t> message_log_commits(0);
+std::atomic<uint64_t> message_log_records(0);
+std::atomic<uint64_t> message_log_dropped(0);
+
+// Which I/O backend drives the sockets, chosen at startup
+enum IoBackend { IO_EPOLL, IO_URING };
+IoBackend io_backend = IO_EPOLL;
+// Messages of history replayed to a client when it registers, and when it joins a room; 0 for none
+size_t history_replay = 0;
+// Number of event loops, each with its own SO_REUSEPORT listener and thread
+int worker_count = 1;
+// Broadcasts to at least this many recipients are handed to every event loop to deliver to its own clients,
+// instead of the sender's loop queueing each one; 0 turns it off
+size_t fanout_min = 1024;
+std::atomic<uint64_t> fanouts(0);
+
+// What to do once a client stops reading and its queued replies pass the high watermark
+enum SlowPolicy { SLOW_DROP, SLOW_COALESCE, SLOW_DISCONNECT };
+SlowPolicy slow_policy = SLOW_DROP;
+// Queued bytes that trigger the policy; twice this is a hard cap at which any client is cut off
+size_t out_high_watermark = 1 << 20;
+// How long the oldest queued reply may wait before the client is cut off (milliseconds)
+uint64_t out_max_age_ms = 30000;
+// Slow-consumer actions taken so far, printed on SIGUSR1
+std::atomic<uint64_t> slow_dropped(0);
+std::atomic<uint64_t> slow_coalesced(0);
+std::atomic<uint64_t> slow_disconnected(0);
+// Resumable sessions (see RESUME): how long a dropped session that has a token waits for its client to come back
+// (0 turns RESUME off), and how many of the bytes last written to it are kept for retransmission
+uint64_t resume_hold_ms = 0;
+size_t resume_window = 256 * 1024;
+#define RESUME_TOKEN_LEN 32
+// Sessions resumed, resumes refused, and dropped sessions whose client did not come back in time
+std::atomic<uint64_t> resumes(0);
+std::atomic<uint64_t> resume_failures(0);
+std::atomic<uint64_t> resume_expired(0);
+// Where the session behind each resume token lives now: its socket descriptor and session generation
+std::mutex resume_mutex;
+std::unordered_map<std::string, std::pair<int, unsigned> > resume_tokens;
+// Message buffers each event loop keeps for reuse, and how many it looks at before allocating another
+#define MESSAGE_POOL_SIZE  256
+#define MESSAGE_POOL_PROBE 8
+// Largest block the reply queues give back for reuse, and how many of each size a thread keeps
+#define RECYCLE_BLOCK_MAX  4096
+#define RECYCLE_KEEP       1024
+// Sends of at least this many bytes go out zero-copy (MSG_ZEROCOPY, or SENDMSG_ZC on io_uring); 0 turns it off
+size_t zerocopy_min = 0;
+// How long the buffers of a reset client are kept in case a driver still has them (milliseconds)
+#define ZEROCOPY_GRACE_MS 1000
+
+// What kind of reply is queued; only public chat may be shed from a slow client's queue.
+// Binary (v2) clients get the kind as the frame's opcode.
+enum ReplyKind { REPLY_DIRECT, REPLY_PUBLIC, REPLY_PRIVATE, REPLY_PRESENCE, REPLY_ERROR, REPLY_HELLO };
+
+// Wire format a client speaks, known from its first bytes
+enum Protocol { PROTO_UNKNOWN, PROTO_TEXT, PROTO_V2 };
+
+// An immutable reply, formatted once and shared by the queue of every client it is sent to
+typedef std::shared_ptr<const std::string> SharedMessage;
+// The user list last formatted and the roster version it was formatted at. Every client sent the list while the
+// roster stays the same is queued this one buffer, and the next request after a join or leave formats a new one.
+std::mutex user_list_mutex;
+SharedMessage user_list;
+uint64_t user_list_version = 0;
+std::atomic<uint64_t> user_list_builds(0);
+std::atomic<uint64_t> user_list_shared(0);
+
+struct OutMessage {
+    SharedMessage data;
+    ReplyKind kind;
+    uint64_t queued_ms;             // event loop clock when it was queued
+    // v2 clients only: the frame header, written ahead of the shared payload
+    unsigned char header_len = 0;
+    unsigned char header[V2_HEADER_SIZE];
+    // A batch of small replies still being added to during this loop iteration (the same string as data)
+    std::string *batch = NULL;
+};
+
+// Blocks the reply queues of this thread gave back, by size
+thread_local std::vector<std::pair<size_t, std::vector<void *> > > recycled_blocks;
 
 /*
- * Function: trim
- * Purpose: To trim the commands off of the input so that the server can evaluate the content in the message
- * Parameters: Message received from the client
+ * Function: recycledList
+ * Purpose: To find this thread's list of spare blocks of a given size
+ * Parameters: The size in bytes
+ * Returns: The list, or NULL for blocks too large to keep
 */
-std::string trim(const std::string& str) {
-    size_t first = str.find_first_not_of(' ');
-    if (first == std::string::npos)
-        return "";
-    size_t last = str.find_last_not_of(' ');
-    return str.substr(first, last - first + 1);
+static std::vector<void *> *recycledList(size_t size) {
+    if (size > RECYCLE_BLOCK_MAX) {
+        return NULL;
+    }
+    for (size_t i = 0; i < recycled_blocks.size(); i++) {
+        if (recycled_blocks[i].first == size) {
+            return &recycled_blocks[i].second;
+        }
+    }
+    recycled_blocks.push_back(std::make_pair(size, std::vector<void *>()));
+    return &recycled_blocks.back().second;
 }
 
+/*
+ * Class: RecyclingAllocator
+ * Purpose: Allocator for the reply queues. A queue gives a block back each time its replies go out past one
+ *          and takes one each time it grows past its last; the blocks are kept on a list per thread, and a
+ *          queue is only ever used on its event loop's thread, so a steady stream of replies does not allocate.
+*/
+template <typename T>
+struct RecyclingAllocator {
+    typedef T value_type;
+    RecyclingAllocator() {}
+    template <typename U> RecyclingAllocator(const RecyclingAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        std::vector<void *> *spare = recycledList(n * sizeof(T));
+        if (spare != NULL && !spare->empty()) {
+            void *block = spare->back();
+            spare->pop_back();
+            return (T *)block;
+        }
+        return (T *)::operator new(n * sizeof(T));
+    }
+    void deallocate(T *block, size_t n) {
+        std::vector<void *> *spare = recycledList(n * sizeof(T));
+        if (spare != NULL && spare->size() < RECYCLE_KEEP) {
+            spare->push_back(block);
+            return;
+        }
+        ::operator delete(block);
+    }
+};
+template <typename T, typename U>
+bool operator==(const RecyclingAllocator<T> &, const RecyclingAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const RecyclingAllocator<T> &, const RecyclingAllocator<U> &) { return false; }
+
+// A client's queued replies, oldest first
+typedef std::deque<OutMessage, RecyclingAllocator<OutMessage> > OutQueue;
+
+// The replies a zero-copy send points at, kept alive until the kernel says it is done reading them
+struct ZeroCopyPin {
+    uint32_t id = 0;                // epoll: the socket's notification counter for this send
+    int sockfd = -1;                // io_uring: the client the send belongs to
+    unsigned generation = 0;
+    uint64_t sent_ms = 0;
+    bool done = false;
+    std::vector<SharedMessage> bufs;
+};
+
+// Bytes received from a client, framed into commands (text lines or v2 frames) as they arrive
+struct RecvRing {
+    std::vector<char> buf;          // IN_RING_SIZE bytes, allocated on the first read
+    size_t head = 0;                // first byte not yet handled; head and tail only grow, masked on use
+    size_t tail = 0;                // one past the last byte received
+    size_t scanned = 0;             // bytes after head already searched for a newline
+    bool discarding = false;        // skipping the rest of an over-long line
+};
+
+// Per-connection state owned by the event loop
+struct ClientSession {
+    int sockfd;
+    struct sockaddr_storage cliaddr;
+    unsigned generation = 0;        // tells a reused descriptor apart from the client that had it before
+    RecvRing in;
+    Protocol proto = PROTO_UNKNOWN;
+    bool replying = false;          // v2: a frame of this client is being handled
+    uint32_t reply_seq = 0;         // v2: its seq, echoed in the replies
+    // Replies waiting for the socket, written by the owning event loop with gathered writes
+    OutQueue outq;
+    size_t out_offset = 0;          // bytes of outq.front() already written
+    size_t out_bytes = 0;           // unwritten bytes across outq
+    bool queued = false;            // already listed in the loop's dirty list
+    uint32_t user_id = NO_USER;     // the roster slot of the user registered on this connection
+    std::vector<Room *> rooms;      // the rooms it is in
+    bool closing = false;           // close once the last reply has been sent
+    bool evicting = false;          // fell too far behind, disconnected at the next flush
+    bool presence_deltas = false;   // sent DELTAS: a page of users on registering, then "+name" and "-name"
+    // epoll backend only: MSG_ZEROCOPY sends the kernel has not reported complete, oldest first
+    std::deque<ZeroCopyPin> zc_pins;
+    uint32_t zc_next_id = 0;
+    bool zc_off = false;            // SO_ZEROCOPY unavailable, or the kernel copies anyway
+    // io_uring backend only: the send in the ring points into outq, so only one may be in flight
+    bool send_inflight = false;
+    size_t inflight_count = 0;      // replies the send covers
+    std::vector<struct iovec> inflight_iov;
+    struct msghdr inflight_msg;
+    // Resumable sessions only. The stream is numbered by byte, from the first byte written on the connection.
+    std::string resume_token;       // empty until the client asks for one
+    uint64_t sent_seq = 0;          // bytes written to the socket so far
+    std::string window;             // the last bytes written, kept for retransmission until the client acks them
+    uint64_t window_seq = 0;        // stream position of window[0]
+    bool parked = false;            // the connection dropped; replies are kept for the client to resume
+    uint64_t parked_until = 0;
+    bool resuming = false;          // sent RESUME, waiting for the session it resumes to be handed over
+    size_t resume_mark = 0;         // replies queued before RESUME; the retransmission goes in after them
+    uint32_t resume_reply_seq = 0;  // v2: the RESUME frame's seq
+};
 
 /*
  * Function: getClientAddrString
@@ -64,471 +478,4548 @@ static std::string getClientAddrString(const struct sockaddr_storage &clientAddr
 }
 
 
-
 /*
- * Function: checkUsernameInFile
- * Purpose: To check if the username is in the file (Will return true if the username is in the file)
- * Parameters: filename, and the username we are looking for
+ * Function: setNonBlocking
+ * Purpose: To put a socket into non-blocking mode so the event loop never stalls on it
+ * Parameters: The socket descriptor
 */
-static bool checkUsernameInFile(const std::string& filename, const std::string& username) {
-    // Lock the Mutex
-    std::lock_guard<std::mutex> lock(reg_users_mutex);
-    // Open the file for reading
-    std::ifstream REG_USERS(filename);
-    if (!REG_USERS.is_open()) {
-        // File does not exist; no usernames are registered yet.
+static bool setNonBlocking(int sockfd) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0) {
         return false;
     }
-    //Declare the line of type string
-    std::string line;
-    // Read each line from the file
-    while (std::getline(REG_USERS, line)) {
-        std::istringstream iss(line);
-        std::string existing_username;
-        // Read only the username
-        iss >> existing_username;
-
-        if (existing_username == username) {
-            // Username exists
-            return true;
-        }
-    }
-    // Username not found, available
-    return false;
+    return fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == 0;
 }
 
 
 /*
- * Function: existing_addr
- * Purpose: To check if the client address is in the file (Will return true if the address is in the file)
- * Parameters: filename, and the client address we are looking for
+ * Function: monotonicMs
+ * Purpose: To read a clock that only moves forward, in milliseconds
 */
-static bool existing_addr(const std::string& filename, const sockaddr_storage cliaddr){
-    // Lock the Mutex
-    std::lock_guard<std::mutex> lock(reg_users_mutex);
-    std::ifstream REG_USERS(filename);
-    if (!REG_USERS.is_open()) {
-        // File does not exist; no addresses are registered yet.
-        return false;
-    }
-
-    // Declare the line and client address of type string
-    std::string line;
-    std::string client_ipaddress = getClientAddrString(cliaddr);
-
-    // Iterate through the file and read the username AND the stored IPaddress
-    while (std::getline(REG_USERS, line)) {
-        std::istringstream iss(line);
-        std::string username, stored_ipaddress;
-        iss >> username >> stored_ipaddress;
-
-        if (stored_ipaddress == client_ipaddress) {
-            // Address exists
-            return true;
-        }
-    }
-    // Address not found, available
-    return false;
+static uint64_t monotonicMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 
-
-static void regWrite(const char *username, const struct sockaddr_storage &clientAddr){
-
-    std::lock_guard<std::mutex> lock(reg_users_mutex);
-    // Create and open the Registered Users file
-    ofstream REG_USERS("REGISTERED_USERS", std::ios::app);
-
-    // Get the string representation of the client address
-    std::string clientAddrStr = getClientAddrString(clientAddr);
-
-    // Write the username and the Client's address to the file
-    REG_USERS << username << " " << clientAddrStr << std::endl;
-
-    // Close the file
-    REG_USERS.close();
-}
-
+// A command off the wire, whichever protocol it came in
+struct Request {
+    CommandScan scan;               // the command and its argument; for PMSG the recipient is the first arg_space bytes
+    const char *text;               // PMSG: the message
+    size_t text_len;
+    bool has_text;                  // PMSG: whether a message came after the recipient
+    long count;                     // HIST: how many messages, LIST: how many names; -1 if that is not a number
+    uint64_t position;              // RESUME and ACK: a stream position, LIST: the cursor
+    bool has_position;              // whether one was given, and is a number
+};
 
 /*
- * Function: broadcastJoin
- * Purpose: This function broadcasts to every other client that someone joined
- * Parameters: The message being sent out, and the socket descriptor of the client joining
+ * Function: ringSpace
+ * Purpose: To point an iovec pair at the free space of a receive ring, so a read can land in it directly
+ * Parameters: The ring, and two iovecs
+ * Returns: The number of iovecs filled in
 */
-void broadcastJoin(const std::string& message, int sender_sockfd) {
-    std::lock_guard<std::mutex> lock(reg_users_mutex);
-    for (int client_sockfd : connected_clients) {
-        // If the client ID isn't the socket ID of the person joining, then send the message to that socket descriptor
-        if (client_sockfd != sender_sockfd) {
-            // Send the message, but if it fails, print out an error message
-            if (send(client_sockfd, message.c_str(), message.size(), 0) < 0) {
-                std::cerr << "Failed to send message to client socket: " << client_sockfd << std::endl;
-            }
-        }
+static int ringSpace(RecvRing &ring, struct iovec *iov) {
+    if (ring.buf.empty()) {
+        ring.buf.resize(IN_RING_SIZE);
     }
+    size_t start = ring.tail & (IN_RING_SIZE - 1);
+    size_t free_bytes = IN_RING_SIZE - (ring.tail - ring.head);
+    size_t first = std::min(free_bytes, (size_t)IN_RING_SIZE - start);
+    iov[0].iov_base = ring.buf.data() + start;
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring.buf.data();
+    iov[1].iov_len = free_bytes - first;
+    return iov[1].iov_len > 0 ? 2 : 1;
 }
 
 /*
- * Function: broadcastToAll
- * Purpose: This function broadcasts to every client when a client leaves
- * Parameters: The message being sent out
+ * Function: ringWrite
+ * Purpose: To append received bytes to a receive ring. The framer never leaves a full line behind, so a
+ *          read of up to BUF_SIZE bytes always fits.
+ * Parameters: The ring, the bytes, and how many there are
 */
-void broadcastToAll(const std::string& message) {
-    std::lock_guard<std::mutex> lock(reg_users_mutex);
-    for (int client_sockfd : connected_clients) {
-        if (send(client_sockfd, message.c_str(), message.size(), 0) < 0) {
-            std::cerr << "Failed to send message to client socket: " << client_sockfd << std::endl;
-        }
+static void ringWrite(RecvRing &ring, const char *data, size_t len) {
+    struct iovec iov[2];
+    int count = ringSpace(ring, iov);
+    for (int i = 0; i < count && len > 0; i++) {
+        size_t n = std::min(len, iov[i].iov_len);
+        memcpy(iov[i].iov_base, data, n);
+        ring.tail += n;
+        data += n;
+        len -= n;
     }
 }
 
-
 /*
- * Function: broadcastMESG
- * Purpose: This function broadcasts to every client what the sender says, and doesn't send to the sender
- * Parameters: The message being sent out, the sender's socket descriptor, and the sender's username
+ * Function: ringCopy
+ * Purpose: To copy bytes out of a receive ring without consuming them, across the wrap if need be
+ * Parameters: The ring, how far past its head to start, where to copy to, and how many bytes
 */
-void broadcastMESG(const std::string& message, int sender_sockfd, const std::string& sender_username) {
-    std::lock_guard<std::mutex> lock(reg_users_mutex);
+static void ringCopy(const RecvRing &ring, size_t offset, char *out, size_t len) {
+    size_t start = (ring.head + offset) & (IN_RING_SIZE - 1);
+    size_t first = std::min(len, (size_t)IN_RING_SIZE - start);
+    memcpy(out, ring.buf.data() + start, first);
+    memcpy(out + first, ring.buf.data(), len - first);
+}
 
-    // Construct the message with the sender's username
-    std::string full_message = sender_username + " (Public): " + message;
+/*
+ * Function: ringNextLine
+ * Purpose: To take the next complete line out of a receive ring. Only bytes that arrived since the last
+ *          call are searched, and lines longer than MAX_LINE are dropped up to their newline.
+ * Parameters: The ring, a buffer of MAX_LINE bytes for the line, its length, and whether a line was too long
+ * Returns: true with the line copied out and null-terminated (without its newline or carriage return),
+ *          or with overflow set for a line that was dropped; false once no complete line is left
+*/
+static bool ringNextLine(RecvRing &ring, char *line, size_t &length, bool &overflow) {
+    overflow = false;
+    for ( ; ; ) {
+        size_t used = ring.tail - ring.head;
+        size_t found = used;
+        while (ring.scanned < used) {
+            size_t start = (ring.head + ring.scanned) & (IN_RING_SIZE - 1);
+            size_t run = std::min(used - ring.scanned, (size_t)IN_RING_SIZE - start);
+            size_t nl = findNewline(ring.buf.data() + start, run);
+            if (nl < run) {
+                found = ring.scanned + nl;
+                break;
+            }
+            ring.scanned += run;
+        }
 
-    // Send the message to all clients except the sender
-    for (int client_sockfd : connected_clients) {
-        if (client_sockfd != sender_sockfd) {
-            if (send(client_sockfd, full_message.c_str(), full_message.size(), 0) < 0) {
-                std::cerr << "Failed to send message to client socket: " << client_sockfd << std::endl;
+        if (found == used) {
+            if (used >= MAX_LINE) {
+                // No newline in sight; drop what we have and keep dropping until one shows up
+                overflow = !ring.discarding;
+                ring.discarding = true;
+                ring.head = ring.tail;
+                ring.scanned = 0;
+                return overflow;
             }
+            return false;
+        }
+
+        length = found;
+        if (!ring.discarding && length < MAX_LINE) {
+            ringCopy(ring, 0, line, length);
+        }
+        ring.head += found + 1;
+        ring.scanned = 0;
+        if (ring.discarding) {
+            // The end of a line that was already reported
+            ring.discarding = false;
+            continue;
+        }
+        if (length >= MAX_LINE) {
+            overflow = true;
+            return true;
+        }
+
+        if (length > 0 && line[length - 1] == '\r') {
+            length--;
         }
+        line[length] = '\0';
+        return true;
     }
 }
 
 /*
- * Function: sendUserList
- * Purpose: This function sends the user list. Usually to a client joining/leaving
- * Parameters: The socket descriptor of the person joining/leaving
+ * Function: outSize
+ * Purpose: To give the bytes a queued reply takes on the wire, frame header included
+ * Parameters: The reply
 */
-void sendUserList(int sockfd){
-    std::lock_guard<std::mutex> lock(reg_users_mutex);
-    std::ostringstream oss;
-    size_t user_count = usernames.size();
+static size_t outSize(const OutMessage &out) {
+    return out.header_len + out.data->size();
+}
 
-    // Construct the message
-    oss << user_count << " Connected Users:\n";
-    for(const auto& user : usernames){
-        oss << user << "\n";
+/*
+ * Function: ringNextFrame
+ * Purpose: To take the next complete v2 frame out of a receive ring. The header says how long the frame
+ *          is, so nothing is scanned.
+ * Parameters: The ring, where to put the header, and a buffer of V2_MAX_PAYLOAD bytes for the payload
+ * Returns: 1 with a frame, 0 if the rest of it has not arrived, -1 if it is too long to ever fit
+*/
+static int ringNextFrame(RecvRing &ring, V2Header &header, char *payload) {
+    size_t used = ring.tail - ring.head;
+    if (used < V2_HEADER_SIZE) {
+        return 0;
     }
-    std::string ack_message = oss.str();
-
-    // Send the message to the client
-    ssize_t bytes_sent = send(sockfd, ack_message.c_str(), ack_message.size(), 0);
-    if (bytes_sent < 0) {
-        std::cerr << "Failed to send ACK to client socket: " << sockfd << " Error: " << strerror(errno) << std::endl;
+    unsigned char raw[V2_HEADER_SIZE];
+    ringCopy(ring, 0, (char *)raw, V2_HEADER_SIZE);
+    header = v2Decode(raw);
+    if (header.length > V2_MAX_PAYLOAD) {
+        return -1;
     }
+    if (used < V2_HEADER_SIZE + header.length) {
+        return 0;
+    }
+    ringCopy(ring, V2_HEADER_SIZE, payload, header.length);
+    ring.head += V2_HEADER_SIZE + header.length;
+    return 1;
 }
 
-
 /*
- * Function: registration
- * Purpose: This function registers the user and also checks the input for correct formatting
- * Parameters: The message being analyzed, the socket descriptor, and the client address
+ * Function: negotiateProtocol
+ * Purpose: To tell from the first bytes of a connection whether the client speaks text or v2. A v2 client
+ *          opens with V2_PREFACE, which is taken off the ring; anything else is left for the line framer.
+ * Parameters: The client
+ * Returns: false until enough bytes have arrived to decide
 */
-static void registration(const char* mesg, int sockfd, const struct sockaddr_storage &cliaddr) {
-    std::string username_string = trim(mesg + 4);
-
-    // Check if username is non-empty after the space
-    if (username_string.empty()) {
-        std::string empty = "Please enter a valid username after 'REG'.\n";
-        send(sockfd, empty.c_str(), empty.size(), 0);
-        return;
+static bool negotiateProtocol(ClientSession &session) {
+    RecvRing &ring = session.in;
+    size_t used = ring.tail - ring.head;
+    if (used == 0) {
+        return false;
     }
-
-    // Validate username length and format
-    size_t username_length = username_string.length();
-    if (username_length < 1) {
-        std::string shortUname = "Please enter a longer username\n";
-        send(sockfd, shortUname.c_str(), shortUname.size(), 0);
-        return;
+    if (ring.buf[ring.head & (IN_RING_SIZE - 1)] != '\0') {
+        session.proto = PROTO_TEXT;
+        return true;
     }
-    // Username too long
-    else if(username_length > 32){
-        std::string lengthError = "ERR 1\n";
-        send(sockfd, lengthError.c_str(), lengthError.size(), 0);
-        return;
+    if (used < V2_PREFACE_LEN) {
+        return false;
     }
-
-    // Check for spaces in the username
-    if (username_string.find(' ') != std::string::npos) {
-        std::string spaceError = "ERR 2\n";
-        send(sockfd, spaceError.c_str(), spaceError.size(), 0);
-        return;
+    char preface[V2_PREFACE_LEN];
+    ringCopy(ring, 0, preface, V2_PREFACE_LEN);
+    if (memcmp(preface, V2_PREFACE, V2_PREFACE_LEN) == 0) {
+        session.proto = PROTO_V2;
+        ring.head += V2_PREFACE_LEN;
+    }
+    else {
+        session.proto = PROTO_TEXT;
     }
+    return true;
+}
 
-    // Check if the username already exists in the file
-    if (checkUsernameInFile("REGISTERED_USERS", username_string)) {
-        std::string userExists = "ERR 3\n";
-        send(sockfd, userExists.c_str(), userExists.size(), 0);
-        return;  // Exit if the username already exists
+/*
+ * Function: gatherOutput
+ * Purpose: To point an iovec array at the front of a client's queued replies. A v2 reply takes two iovecs,
+ *          its own header and the payload it shares with the other recipients.
+ * Parameters: The client, the iovec array, its capacity, and where to count the replies it covers
+ * Returns: The number of iovecs filled in
+*/
+static int gatherOutput(const ClientSession &session, struct iovec *iov, int max_iov, size_t *replies = NULL) {
+    int count = 0;
+    size_t used = 0;
+    for (OutQueue::const_iterator it = session.outq.begin(); it != session.outq.end(); ++it) {
+        if (count + (it->header_len > 0 ? 2 : 1) > max_iov) {
+            break;
+        }
+        size_t skip = (used == 0) ? session.out_offset : 0;
+        if (skip < it->header_len) {
+            iov[count].iov_base = (void *)(it->header + skip);
+            iov[count].iov_len = it->header_len - skip;
+            count++;
+            skip = 0;
+        }
+        else {
+            skip -= it->header_len;
+        }
+        iov[count].iov_base = (void *)(it->data->data() + skip);
+        iov[count].iov_len = it->data->size() - skip;
+        count++;
+        used++;
     }
-    // If the username exists already
-    if(existing_addr("REGISTERED_USERS", cliaddr)){
-        std::string addrExists = "You already have a username.\n";
-        send(sockfd, addrExists.c_str(), addrExists.size(), 0);
-        return;
+    if (replies != NULL) {
+        *replies = used;
     }
+    return count;
+}
 
-    // Write the username to the file if it's valid and doesn't exist
-    regWrite(username_string.c_str(), cliaddr);
-    {
-        // Lock the mutex
-        std::lock_guard<std::mutex> lock(reg_users_mutex);
-        // Add the new username to the list
-        usernames.push_back(username_string);
-        // Add the new socket to the list
-        connected_clients.push_back(sockfd);
-        // Map the socket to the username
-        client_usernames[sockfd] = username_string;
+/*
+ * Function: copyOutput
+ * Purpose: To append part of a queued reply, as it goes on the wire, to a string
+ * Parameters: The reply, the offset and length of the part, and the string
+*/
+static void copyOutput(const OutMessage &out, size_t offset, size_t length, std::string &to) {
+    if (offset < out.header_len) {
+        size_t n = std::min(length, out.header_len - offset);
+        to.append((const char *)out.header + offset, n);
+        offset += n;
+        length -= n;
     }
+    to.append(*out.data, offset - out.header_len, length);
+}
 
-    // Send ACK to the newly registered user with the list of connected users
-    sendUserList(sockfd);
-
-    // Broadcast to other users that a new user has joined
-    std::string join_message = username_string + " has joined the chat.\n";
-    broadcastJoin(join_message, sockfd);
+/*
+ * Function: consumeOutput
+ * Purpose: To drop the bytes the kernel accepted from the front of a client's queue, keeping the rest of a partly
+ *          written reply. A resumable session keeps a copy of them in its window, which is cut back to its size
+ *          once it has grown to twice that, so the copy stays a plain append.
+ * Parameters: The client, and the number of bytes written
+*/
+static void consumeOutput(ClientSession &session, size_t written) {
+    session.out_bytes -= written;
+    session.sent_seq += written;
+    bool keep = !session.resume_token.empty();
+    while (written > 0) {
+        size_t remaining = outSize(session.outq.front()) - session.out_offset;
+        if (keep) {
+            copyOutput(session.outq.front(), session.out_offset, std::min(written, remaining), session.window);
+        }
+        if (written < remaining) {
+            session.out_offset += written;
+            break;
+        }
+        written -= remaining;
+        session.outq.pop_front();
+        session.out_offset = 0;
+        if (session.resume_mark > 0) {
+            session.resume_mark--;
+        }
+    }
+    if (keep && session.window.size() > 2 * resume_window) {
+        size_t cut = session.window.size() - resume_window;
+        session.window.erase(0, cut);
+        session.window_seq += cut;
+    }
 }
 
+/*
+ * Function: pinOutput
+ * Purpose: To keep the replies a zero-copy send points at alive after they leave the queue
+ * Parameters: The client, how many bytes from the front of its queue the send covers, and where to keep them
+*/
+static void pinOutput(const ClientSession &session, size_t written, std::vector<SharedMessage> &bufs) {
+    written += session.out_offset;
+    for (OutQueue::const_iterator it = session.outq.begin(); it != session.outq.end() && written > 0; ++it) {
+        bufs.push_back(it->data);
+        written -= std::min(written, outSize(*it));
+    }
+}
 
 /*
- * Function: sendPrivateMessage
- * Purpose: This function lets one client send a private message to another client
- * Parameters: The recipient's username, the message being sent, the file descriptor of the receiver, and the sender's username
+ * Function: sealOutput
+ * Purpose: To stop adding to a client's open batch buffer before a write points at it
+ * Parameters: The client
 */
-void sendPrivateMessage(const std::string& recipient_username, const std::string& message, int sender_sockfd, const std::string& sender_username) {
-    // Lock the mutex
-    std::lock_guard<std::mutex> lock(reg_users_mutex);
+static void sealOutput(ClientSession &session) {
+    if (!session.outq.empty()) {
+        session.outq.back().batch = NULL;
+    }
+}
 
-    // Find the socket descriptor of the recipient
-    int recipient_sockfd = -1;
-    for (const auto& pair : client_usernames) {
-        if (pair.second == recipient_username) {
-            recipient_sockfd = pair.first;
-            break;
-        }
+/*
+ * Function: pinnedOutput
+ * Purpose: To count the replies at the front of a client's queue that a write is already using and that must stay put
+ * Parameters: The client
+*/
+static size_t pinnedOutput(const ClientSession &session) {
+    if (session.send_inflight) {
+        return session.inflight_count;
     }
+    return session.out_offset > 0 ? 1 : 0;
+}
 
-    if (recipient_sockfd == -1) {
-        // Recipient not found, send error to sender
-        std::string error_msg = "ERR 3\n";  // Error code for unknown user
-        send(sender_sockfd, error_msg.c_str(), error_msg.size(), 0);
-        return;
+/*
+ * Function: discardOutput
+ * Purpose: To throw away everything queued for a client that is not already being written
+ * Parameters: The client
+*/
+static void discardOutput(ClientSession &session) {
+    size_t keep = pinnedOutput(session);
+    while (session.outq.size() > keep) {
+        session.out_bytes -= outSize(session.outq.back());
+        session.outq.pop_back();
+    }
+    if (session.outq.empty()) {
+        session.out_offset = 0;
+        session.out_bytes = 0;
     }
+}
 
-    // Construct the message
-    std::string full_message = "From " + sender_username + " (private): " + message;
+/*
+ * Function: frameHeader
+ * Purpose: To write the v2 frame header for a reply to a client
+ * Parameters: The client, the kind of reply, its length, and where to put the V2_HEADER_SIZE bytes
+*/
+static void frameHeader(const ClientSession &session, ReplyKind kind, size_t length, unsigned char *out) {
+    static const unsigned char opcodes[] = { V2_REPLY, V2_PUBLIC, V2_PRIVATE, V2_PRESENCE, V2_ERROR, V2_HELLO };
+    V2Header header;
+    header.length = length;
+    header.opcode = opcodes[kind];
+    header.flags = session.replying ? V2_FLAG_REPLY : 0;
+    header.seq = session.replying ? session.reply_seq : 0;
+    v2Encode(out, header);
+}
 
-    // Send the message to the recipient
-    if (send(recipient_sockfd, full_message.c_str(), full_message.size(), 0) < 0) {
-        std::cerr << "Failed to send private message to client socket: " << recipient_sockfd << std::endl;
+/*
+ * Function: frameReply
+ * Purpose: To give a reply queued for a v2 client its frame header. The payload stays shared; only the
+ *          header is per client.
+ * Parameters: The client, and the queued reply
+*/
+static void frameReply(const ClientSession &session, OutMessage &out) {
+    if (session.proto != PROTO_V2) {
+        return;
     }
+    frameHeader(session, out.kind, out.data->size(), out.header);
+    out.header_len = V2_HEADER_SIZE;
 }
 
 /*
- * Function: removeUserFromFile
- * Purpose: This function removes a client from all data structures that hold information about that client
- * Parameters: The filename, and the client's username who is leaving
+ * Function: shedOutput
+ * Purpose: To apply the slow-consumer policy once a client's queue passes the high watermark. Public chat is
+ *          dropped oldest first (or collapsed into one notice) down to half the watermark; if that is not
+ *          enough, or the policy says so, the client is marked for disconnection.
+ *          Only the tail of the deque is compacted, in place, so replies a write is using keep their addresses.
+ * Parameters: The client, and the event loop clock
 */
-void removeUserFromFile(const std::string& filename, const std::string& username) {
-    //Lock the mutex
-    std::lock_guard<std::mutex> lock(reg_users_mutex);
-    std::ifstream infile(filename);
-    // If the file is open, print error message
-    if (!infile.is_open()) {
-        std::cerr << "Error opening the file!" << std::endl;
+static void shedOutput(ClientSession &session, uint64_t now_ms) {
+    bool too_old = now_ms - session.outq.front().queued_ms > out_max_age_ms;
+    if (session.out_bytes <= out_high_watermark && !too_old) {
         return;
     }
-    // Declare line data type
-    std::vector<std::string> lines;
-    std::string line;
-    // Parse the file and remove the user
-    while (std::getline(infile, line)) {
-        std::istringstream iss(line);
-        std::string existing_username;
-        iss >> existing_username;
-        if (existing_username != username) {
-            lines.push_back(line);
+
+    if (slow_policy != SLOW_DISCONNECT && !too_old) {
+        size_t keep = pinnedOutput(session);
+        size_t low_watermark = out_high_watermark / 2;
+        uint64_t shed = 0;
+        size_t notice = 0;              // where the coalesced notice goes, 0 while there is none
+        // Close the gaps in place, oldest first: nothing is allocated, and the replies before `keep` stay put
+        size_t kept = keep;
+        for (size_t i = keep; i < session.outq.size(); i++) {
+            OutMessage &reply = session.outq[i];
+            if (reply.kind == REPLY_PUBLIC && session.out_bytes > low_watermark) {
+                session.out_bytes -= outSize(reply);
+                shed++;
+                if (slow_policy == SLOW_COALESCE && notice == 0) {
+                    // Placeholder with no buffer, in the first dropped reply's place, filled in once we know
+                    // how much was skipped
+                    uint64_t queued_ms = reply.queued_ms;
+                    OutMessage &placeholder = session.outq[kept];
+                    placeholder.data.reset();
+                    placeholder.kind = REPLY_DIRECT;
+                    placeholder.queued_ms = queued_ms;
+                    placeholder.header_len = 0;
+                    placeholder.batch = NULL;
+                    notice = ++kept;
+                }
+                continue;
+            }
+            if (kept != i) {
+                session.outq[kept] = std::move(reply);
+            }
+            kept++;
+        }
+        while (session.outq.size() > kept) {
+            session.outq.pop_back();
         }
-    }
-    infile.close();
 
-    // Now write back to the file without the user's line
-    std::ofstream outfile(filename, std::ios::trunc);
-    if (!outfile.is_open()) {
-        std::cerr << "Error opening the file!" << std::endl;
-        return;
+        if (notice != 0) {
+            OutMessage &placeholder = session.outq[notice - 1];
+            placeholder.data = std::make_shared<const std::string>(
+                "*** " + std::to_string(shed) + " public messages skipped ***\n");
+            frameReply(session, placeholder);
+            session.out_bytes += outSize(placeholder);
+            slow_coalesced += shed;
+        }
+        else {
+            slow_dropped += shed;
+        }
     }
-    for (const auto& l : lines) {
-        outfile << l << std::endl;
+
+    if (too_old || slow_policy == SLOW_DISCONNECT || session.out_bytes > 2 * out_high_watermark) {
+        // Cut the client off; the leave is handled at the next flush, outside whatever lock the caller holds
+        discardOutput(session);
+        session.evicting = true;
     }
-    outfile.close();
 }
 
+
 /*
- * Function: handleClient
- * Purpose: This function is the control center for the server. This will direct every function and knows where to go
- * Parameters: The file descriptor, and the Address of the client.
+ * io_uring backend
+ *
+ * The ring is driven through the raw system calls so the server still builds with nothing but the kernel
+ * headers. The listener gets one multishot accept, every client one multishot recv that takes its buffers
+ * from a shared provided-buffer ring, and replies are queued per client and submitted together with a
+ * single io_uring_enter() per loop iteration, so a broadcast to N clients costs one system call.
 */
-void handleClient(int newsockfd, struct sockaddr_storage cliaddr) {
-    int datalen;
-    char mesg[BUF_SIZE];
+#define URING_ENTRIES    4096
+#define URING_BUF_COUNT  1024   /* must be a power of two */
+#define URING_BUF_GROUP  0
 
-    while ((datalen = recv(newsockfd, mesg, BUF_SIZE, 0)) > 0) {
-        mesg[datalen] = '\0';  // Null-terminate the message
+// What a completion belongs to, packed into the top byte of its user_data
+enum UringOp { URING_ACCEPT = 1, URING_RECV, URING_SEND, URING_CANCEL, URING_WAKE, URING_TICK, URING_SEND_ZC };
 
-        // Trim the message to handle whitespace-only commands
-        std::string trimmed_message = trim(mesg);
+struct UringQueue {
+    int ring_fd = -1;
+    unsigned sq_entries = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit = 0;             // SQEs written but not yet handed to the kernel
+    struct io_uring_buf *buf_ring;      // indexed directly, the header's flex array is laid out differently in C++
+    unsigned short *buf_ring_tail;
+    char *bufs;
+    unsigned short buf_tail = 0;
+};
 
-        if (trimmed_message.empty()) {
-            memset(mesg, 0, BUF_SIZE);  // Clear the buffer
-            continue; // Ignore empty or whitespace-only messages
-        }
+// A session moving to a new connection (see RESUME). The new connection's loop sends it to the loop of the
+// session it resumes, which hands back the session's state in it.
+struct ResumeState {
+    int sockfd;                     // the new connection
+    unsigned generation;
+    Protocol proto;
+    uint32_t reply_seq;
+    uint64_t position;              // where the client's copy of the stream ends
+    std::string token;
+    bool answered = false;          // set by the old session's loop
+    bool ok = false;
+    uint32_t user_id = NO_USER;
+    std::vector<Room *> rooms;
+    bool presence_deltas = false;
+    std::string retransmit;         // the stream from the client's position on
+};
 
-        // If the command is REG, perform registration
-        if (strncmp(mesg, "REG ", 4) == 0) {
-            registration(mesg, newsockfd, cliaddr);
-        }
-            // If the command is MESG, get the username, content, and broadcast it
-        else if (strncmp(mesg, "MESG ", 5) == 0) {
-            std::string sender_username = client_usernames[newsockfd];
-            std::string message_content = trim(mesg + 5);
-            broadcastMESG(message_content, newsockfd, sender_username);
-        }
-            // If the command is PMSG, handle private messaging
-        else if(strncmp(mesg, "PMSG ", 5) == 0){
-            std::string sender_username = client_usernames[newsockfd];
-            std::string rest_of_message = trim(mesg + 5);
+// A reply produced on one event loop for a client owned by another. A sockfd of -1 is a broadcast the loop
+// delivers to all of its own clients in the audience: the members of a room, or everyone registered.
+struct RemoteReply {
+    int sockfd;
+    unsigned generation;
+    ReplyKind kind;
+    SharedMessage message;
+    SharedMessage delta;                        // a join or leave as clients that sent DELTAS get it
+    std::shared_ptr<const RoomMembers> room;
+    std::shared_ptr<ResumeState> resume;        // a session moving; see ResumeState
+};
 
-            size_t space_pos = rest_of_message.find(' ');
-            if (space_pos == std::string::npos) {
-                std::string UnknownError = "ERR 4\n";
-                send(newsockfd, UnknownError.c_str(), UnknownError.size(), 0);
-                continue;
-            }
+// Slots in each event loop's mailbox (a power of two)
+#define MAILBOX_SLOTS 16384
 
-            std::string recipient_username = rest_of_message.substr(0, space_pos);
-            std::string message_content = trim(rest_of_message.substr(space_pos + 1));
+// One mailbox slot. seq says whose turn it is: the slot's position when it is free to fill, one more than
+// that once it holds a reply, and MAILBOX_SLOTS more once the owner has taken the reply out.
+struct MailSlot {
+    std::atomic<size_t> seq;
+    RemoteReply reply;
+};
 
-            sendPrivateMessage(recipient_username, message_content, newsockfd, sender_username);
-        }
-            // If the message is EXIT, handle the user exit
-        else if(trimmed_message == "EXIT") {
-            std::string username = client_usernames[newsockfd];
+/*
+ * The replies other threads leave for an event loop's clients: a bounded ring any thread may add to without
+ * a lock, emptied only by the owning loop, which then writes the sockets itself. Should the ring fill up,
+ * replies go to a locked overflow list until the owner has emptied it, so every sender's replies still
+ * arrive in the order they were sent.
+*/
+struct Mailbox {
+    std::unique_ptr<MailSlot[]> slots;
+    std::atomic<size_t> enqueue_pos{0};
+    char pad[64];                       // keeps the senders' counter and the owner's on separate cache lines
+    size_t dequeue_pos = 0;
+    std::atomic<bool> overflowing{false};
+    std::mutex overflow_mutex;
+    std::vector<RemoteReply> overflow;
+    // Set by the first sender after the owner last looked, who also writes the owner's eventfd
+    std::atomic<bool> wake_pending{false};
+};
 
-            // Remove the user from REGISTERED_USERS file
-            removeUserFromFile("REGISTERED_USERS", username);
+/*
+ * One event loop. Every worker thread runs one, with its own listener, its own backend state, and the
+ * clients it accepted. Client sockets are only ever touched by their owning loop; replies from other
+ * loops are dropped into its mailbox and the owner is woken through its eventfd.
+*/
+struct Reactor {
+    int index = 0;
+    int listen_fd = -1;
+    int wake_fd = -1;
+    IoBackend backend = IO_EPOLL;
+    uint64_t now_ms = 0;            // clock read once per loop iteration, stamps queued replies
+    int epfd = -1;                  // epoll backend
+    UringQueue uring;               // io_uring backend
+    uint64_t wake_value = 0;        // io_uring reads the eventfd into this
+    // Clients with replies queued since the loop last flushed, and the list being flushed (epoll backend)
+    std::vector<int> dirty;
+    std::vector<int> flushing;
+    // Closed clients whose last replies are still being written
+    std::vector<int> draining;
+    // Dropped sessions waiting for their client to resume them, with their generation
+    std::vector<std::pair<int, unsigned> > parked;
+    bool tick_armed = false;        // io_uring backend: a one-second timeout is in the ring
+    bool zerocopy = false;          // large sends go out zero-copy
+    // epoll backend: zero-copy buffers of clients that were reset, freed after a grace period
+    std::vector<ZeroCopyPin> zc_orphans;
+    // Every open client socket of this loop, keyed by its socket descriptor
+    std::unordered_map<int, ClientSession> sessions;
+    Mailbox mailbox;
+    // Message buffers, handed out again once every queue they were shared with has let go (see takeBuffer())
+    std::vector<std::shared_ptr<std::string> > buffer_pool;
+    size_t buffer_next = 0;
+    // The roster epoch when this loop last woke up, or ROSTER_OFFLINE while it waits
+    std::atomic<uint64_t> roster_seen{ROSTER_OFFLINE};
+    // Records for the message log, not yet numbered, waiting for the writer thread to take them all at once
+    std::mutex log_mutex;
+    std::string log_pending;
+    bool log_wake = false;          // records were left this iteration; see wakeMessageLog()
+    std::thread thread;
+};
+std::vector<Reactor *> reactors;
+// The event loop running on this thread
+thread_local Reactor *current_reactor = NULL;
+// Owner of every open client descriptor: (reactor index + 1) << 32 | session generation, 0 when closed
+std::atomic<uint64_t> *fd_owners = NULL;
+size_t fd_owners_size = 0;
+// Most descriptors the table covers (32 MB of it), however high the descriptor limit goes; clients accepted on
+// a descriptor above it are turned away
+#define FD_OWNERS_MAX (4u << 20)
+std::atomic<unsigned> session_generation(0);
 
-            // Notify other users that the user has left
-            std::string leave_message = username + " has left the chat.\n";
-            broadcastToAll(leave_message);
+/*
+ * Function: rosterOnline / rosterOffline
+ * Purpose: To tell roster writers when this event loop may be reading roster slots. Handlers only use a slot
+ *          within one loop iteration, so between iterations the loop holds none (a quiescent state), and while
+ *          it waits for events it holds none for as long as it waits.
+ * Parameters: The event loop
+*/
+static void rosterOnline(Reactor &reactor) {
+    reactor.roster_seen.store(roster_epoch.load());
+}
 
+static void rosterOffline(Reactor &reactor) {
+    reactor.roster_seen.store(ROSTER_OFFLINE);
+}
 
+/*
+ * Function: rosterEntry / rosterName
+ * Purpose: To find a user's roster slot, and the name stored in it, by ID
+ * Parameters: The ID
+*/
+static RosterEntry &rosterEntry(uint32_t id) {
+    return roster_chunks[id / ROSTER_CHUNK_SLOTS]->entries[id % ROSTER_CHUNK_SLOTS];
+}
 
+static RosterName &rosterName(uint32_t id) {
+    return roster_chunks[id / ROSTER_CHUNK_SLOTS]->names[id % ROSTER_CHUNK_SLOTS];
+}
 
-            // Remove the user from the server's data structures
-            {
-                std::lock_guard<std::mutex> lock(reg_users_mutex);
-                connected_clients.erase(std::remove(connected_clients.begin(), connected_clients.end(), newsockfd), connected_clients.end());
-                client_usernames.erase(newsockfd);
-                usernames.erase(std::remove(usernames.begin(), usernames.end(), username), usernames.end());
-            }
-            //Send the user list after the client credentials have been removed
-            sendUserList(newsockfd);
-            // Close the socket and exit the function
-            close(newsockfd);
-            return;
+/*
+ * Function: rosterReserve
+ * Purpose: To take an ID for a user about to register. Slots emptied in an epoch every event loop has since
+ *          recorded (or that find it offline) are free again: such a loop started its iteration after the
+ *          slot was emptied, so it cannot still be reading it. A new chunk of slots is added when none is free.
+ * Returns: The ID, or NO_USER if the roster is full
+*/
+static uint32_t rosterReserve() {
+    std::lock_guard<std::mutex> lock(roster_mutex);
+    if (!roster_retired.empty()) {
+        uint64_t oldest = ROSTER_OFFLINE;
+        for (size_t i = 0; i < reactors.size(); i++) {
+            oldest = std::min(oldest, reactors[i]->roster_seen.load());
         }
-            // Unknown command handling
-        else {
-            std::string UnknownError = "ERR 4\n";
-            send(newsockfd, UnknownError.c_str(), UnknownError.size(), 0);
+        size_t kept = 0;
+        for (size_t i = 0; i < roster_retired.size(); i++) {
+            if (roster_retired[i].second <= oldest) {
+                roster_free.push_back(roster_retired[i].first);
+            }
+            else {
+                roster_retired[kept++] = roster_retired[i];
+            }
         }
-        // Clear the buffer for the next message
-        memset(mesg, 0, BUF_SIZE);
+        roster_retired.resize(kept);
     }
-
-    // If the loop exits due to a sudden disconnect (recv() returns 0 or negative value)
-    if (datalen < 0) {
-        std::cerr << "Error receiving from client" << std::endl;
+    if (!roster_free.empty()) {
+        uint32_t id = roster_free.back();
+        roster_free.pop_back();
+        return id;
     }
-    else if(datalen == 0){
-        // Handle the disconnection:
-        std::string disconnected_username = client_usernames[newsockfd];
-
-        // Notify other users that the user has left
-        std::string leave_message = disconnected_username + " has left the chat.\n";
-        broadcastToAll(leave_message);
 
-        // Lock the mutex and clean up the client's data from the server
-        {
-            std::lock_guard<std::mutex> lock(reg_users_mutex);
-            connected_clients.erase(std::remove(connected_clients.begin(), connected_clients.end(), newsockfd), connected_clients.end());
-            client_usernames.erase(newsockfd);
-            usernames.erase(std::remove(usernames.begin(), usernames.end(), disconnected_username), usernames.end());
+    uint32_t id = roster_size.load();
+    if (id >= (uint32_t)ROSTER_CHUNKS * ROSTER_CHUNK_SLOTS) {
+        return NO_USER;
+    }
+    if (id % ROSTER_CHUNK_SLOTS == 0) {
+        RosterChunk *chunk = new RosterChunk;
+        for (size_t i = 0; i < ROSTER_CHUNK_SLOTS; i++) {
+            chunk->entries[i].sockfd.store(-1);
         }
-
-        // Remove the user from REGISTERED_USERS file
-        removeUserFromFile("REGISTERED_USERS", disconnected_username);
-
-        // Close the socket for the disconnected client
-        close(newsockfd);
+        roster_chunks[id / ROSTER_CHUNK_SLOTS] = chunk;
     }
+    roster_size.store(id + 1);
+    return id;
 }
 
 /*
- * Function: main
- * Purpose: This function keeps the server on, and has to be here
+ * Function: rosterJoin
+ * Purpose: To fill a reserved slot and make it visible to broadcasts. The slot is written before it is marked
+ *          in use, so a reader that sees the descriptor sees the rest of it.
+ * Parameters: The ID, the client's socket descriptor and session generation, the username, and whether the
+ *             client asked for presence deltas
 */
+static void rosterJoin(uint32_t id, int sockfd, unsigned generation, const std::string& username, bool deltas) {
+    RosterName &name = rosterName(id);
+    name.len = username.size();
+    memcpy(name.text, username.data(), username.size());
+    RosterEntry &entry = rosterEntry(id);
+    entry.generation = generation;
+    entry.deltas = deltas;
+    entry.sockfd.store(sockfd);
+    roster_online++;
+    roster_version++;
+}
 
-int main(int argc, char **argv)
-{
-    int sockfd;      /* socket listening for incoming connections */
-    int newsockfd;   /* socket created for sending and receiving data */
-    struct addrinfo hints = {0};
-    struct addrinfo *servinfo;
-    struct sockaddr_storage cliaddr; /* will store address of the client */
-    socklen_t addrlen;
+/*
+ * Function: rosterRelease
+ * Purpose: To give back an ID that was reserved but never joined, which no one can have seen
+ * Parameters: The ID
+*/
+static void rosterRelease(uint32_t id) {
+    std::lock_guard<std::mutex> lock(roster_mutex);
+    roster_free.push_back(id);
+}
 
-    hints.ai_family = AF_UNSPEC; 	// either IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM;	// TCP stream socket
-    hints.ai_flags = AI_PASSIVE;	// fill in my IP for me
+/*
+ * Function: rosterLeave
+ * Purpose: To empty a user's slot. It is only reused once the epoch it was emptied in has passed.
+ * Parameters: The ID
+*/
+static void rosterLeave(uint32_t id) {
+    rosterEntry(id).sockfd.store(-1);
+    roster_online--;
+    roster_version++;
+    std::lock_guard<std::mutex> lock(roster_mutex);
+    roster_retired.push_back(std::make_pair(id, ++roster_epoch));
+}
 
+/*
+ * Function: markDirty
+ * Purpose: To have the event loop flush a client's queue at the end of the current iteration
+ * Parameters: The event loop, and the client
+*/
+static void markDirty(Reactor &reactor, ClientSession &session) {
+    if (!session.queued) {
+        session.queued = true;
+        reactor.dirty.push_back(session.sockfd);
+    }
+}
 
-    if ((getaddrinfo(NULL, MY_PORT, &hints, &servinfo)) != 0) {
-        cerr << "server: can't get address info" << endl;
-        exit(1);
+/*
+ * Function: kernelAtLeast
+ * Purpose: To check the running kernel version, multishot recv needs 6.0 even where the ring itself works
+ * Parameters: The required major and minor version
+*/
+static bool kernelAtLeast(int major, int minor) {
+    struct utsname uts;
+    int kmajor = 0, kminor = 0;
+    if (uname(&uts) != 0 || sscanf(uts.release, "%d.%d", &kmajor, &kminor) != 2) {
+        return false;
     }
+    return kmajor > major || (kmajor == major && kminor >= minor);
+}
 
-    int datalen;
-    char mesg[BUF_SIZE];
+static uint64_t uringUserData(UringOp op, int fd, unsigned generation) {
+    return ((uint64_t)op << 56) | ((uint64_t)(generation & 0xffffff) << 32) | (uint32_t)fd;
+}
 
-    /*
-     * Open a TCP socket (an Internet stream socket).
-     */
-    if ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) < 0) {
-        cerr << "server: can't open stream socket" << endl;
-        exit(1);
+/*
+ * Function: uringSubmit
+ * Purpose: To hand every queued SQE to the kernel, optionally waiting for completions
+ * Parameters: The number of completions to wait for
+*/
+static int uringSubmit(Reactor &reactor, unsigned wait_for) {
+    for ( ; ; ) {
+        int ret = syscall(__NR_io_uring_enter, reactor.uring.ring_fd, reactor.uring.to_submit, wait_for,
+                          wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            reactor.uring.to_submit -= std::min((unsigned)ret, reactor.uring.to_submit);
+            return ret;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
     }
+}
 
-    /*
-     * Bind our local address so that the client can send to us.
-     */
-    if (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) < 0) {
-        cerr << "server: can't bind local address" << endl;
-        exit(1);
+/*
+ * Function: uringGetSqe
+ * Purpose: To claim the next submission slot, flushing the queue to the kernel if it is full.
+ *          Without SQPOLL the kernel only reads the ring inside io_uring_enter(), so the tail can be
+ *          published before the entry is filled in.
+*/
+static struct io_uring_sqe *uringGetSqe(Reactor &reactor) {
+    unsigned tail = *reactor.uring.sq_tail;
+    if (tail - __atomic_load_n(reactor.uring.sq_head, __ATOMIC_ACQUIRE) >= reactor.uring.sq_entries) {
+        uringSubmit(reactor, 0);
+        if (tail - __atomic_load_n(reactor.uring.sq_head, __ATOMIC_ACQUIRE) >= reactor.uring.sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned index = tail & *reactor.uring.sq_mask;
+    struct io_uring_sqe *sqe = &reactor.uring.sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    reactor.uring.sq_array[index] = index;
+    __atomic_store_n(reactor.uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    reactor.uring.to_submit++;
+    return sqe;
+}
+
+/*
+ * Function: uringProvideBuffer
+ * Purpose: To give a receive buffer back to the kernel once its contents have been handled
+ * Parameters: The buffer ID
+*/
+static void uringProvideBuffer(Reactor &reactor, unsigned short bid) {
+    struct io_uring_buf *buf = &reactor.uring.buf_ring[reactor.uring.buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(reactor.uring.bufs + (size_t)bid * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    reactor.uring.buf_tail++;
+    __atomic_store_n(reactor.uring.buf_ring_tail, reactor.uring.buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function: uringSetup
+ * Purpose: To create the ring and register the provided-buffer ring. Returns false when the kernel
+ *          lacks anything the backend relies on, so the caller can fall back to epoll.
+*/
+static bool uringSetup(Reactor &reactor) {
+    if (!kernelAtLeast(6, 0)) {
+        return false;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    int ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring_fd < 0) {
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring_fd);
+        return false;
+    }
+
+    // The SQ and CQ rings share one mapping, the SQE array has its own
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = std::max(sq_size, cq_size);
+    char *ring = (char *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        close(ring_fd);
+        return false;
+    }
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(ring, ring_size);
+        close(ring_fd);
+        return false;
+    }
+
+    // Receive buffers shared by every client, picked by the kernel as data arrives
+    size_t buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    void *buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (buf_ring == MAP_FAILED ||
+        syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        if (buf_ring != MAP_FAILED) {
+            munmap(buf_ring, buf_ring_size);
+        }
+        munmap(sqes, sqes_size);
+        munmap(ring, ring_size);
+        close(ring_fd);
+        return false;
+    }
+
+    reactor.uring.ring_fd = ring_fd;
+    reactor.uring.sq_entries = params.sq_entries;
+    reactor.uring.sq_head = (unsigned *)(ring + params.sq_off.head);
+    reactor.uring.sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    reactor.uring.sq_mask = (unsigned *)(ring + params.sq_off.ring_mask);
+    reactor.uring.sq_array = (unsigned *)(ring + params.sq_off.array);
+    reactor.uring.sqes = (struct io_uring_sqe *)sqes;
+    reactor.uring.cq_head = (unsigned *)(ring + params.cq_off.head);
+    reactor.uring.cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    reactor.uring.cq_mask = (unsigned *)(ring + params.cq_off.ring_mask);
+    reactor.uring.cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    reactor.uring.buf_ring = (struct io_uring_buf *)buf_ring;
+    reactor.uring.buf_ring_tail = &((struct io_uring_buf_ring *)buf_ring)->tail;
+    reactor.uring.bufs = new char[(size_t)URING_BUF_COUNT * BUF_SIZE];
+    for (unsigned bid = 0; bid < URING_BUF_COUNT; bid++) {
+        uringProvideBuffer(reactor, bid);
+    }
+    return true;
+}
+
+static void uringArmAccept(Reactor &reactor) {
+    struct io_uring_sqe *sqe = uringGetSqe(reactor);
+    if (sqe == NULL) {
+        cerr << "server: io_uring submission queue is full" << endl;
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reactor.listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uringUserData(URING_ACCEPT, reactor.listen_fd, 0);
+}
+
+static void uringArmRecv(Reactor &reactor, const ClientSession &session) {
+    struct io_uring_sqe *sqe = uringGetSqe(reactor);
+    if (sqe == NULL) {
+        cerr << "server: io_uring submission queue is full" << endl;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = session.sockfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = uringUserData(URING_RECV, session.sockfd, session.generation);
+}
+
+static void uringArmWake(Reactor &reactor) {
+    struct io_uring_sqe *sqe = uringGetSqe(reactor);
+    if (sqe == NULL) {
+        cerr << "server: io_uring submission queue is full" << endl;
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = reactor.wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&reactor.wake_value;
+    sqe->len = sizeof reactor.wake_value;
+    sqe->user_data = uringUserData(URING_WAKE, reactor.wake_fd, 0);
+}
+
+/*
+ * Function: uringFlushSends
+ * Purpose: To prepare one sendmsg per client with queued replies. Only one send per socket is ever in the
+ *          ring, which keeps replies in order and lets short writes be resumed where they stopped.
+ * Parameters: The event loop
+*/
+static void uringFlushSends(Reactor &reactor) {
+    for (size_t i = 0; i < reactor.dirty.size(); i++) {
+        std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(reactor.dirty[i]);
+        if (it == reactor.sessions.end()) {
+            continue;
+        }
+        ClientSession &session = it->second;
+        session.queued = false;
+        if (session.send_inflight || session.out_bytes == 0 || session.evicting || session.parked || session.resuming) {
+            continue;
+        }
+        struct io_uring_sqe *sqe = uringGetSqe(reactor);
+        if (sqe == NULL) {
+            cerr << "server: io_uring submission queue is full" << endl;
+            continue;
+        }
+        // The iovecs and header must stay put until the send completes, so they live in the session
+        sealOutput(session);
+        session.inflight_iov.resize(std::min(2 * session.outq.size(), (size_t)FLUSH_IOVECS));
+        memset(&session.inflight_msg, 0, sizeof session.inflight_msg);
+        session.inflight_msg.msg_iov = session.inflight_iov.data();
+        session.inflight_msg.msg_iovlen = gatherOutput(session, session.inflight_iov.data(), session.inflight_iov.size(),
+                                                       &session.inflight_count);
+        session.send_inflight = true;
+        size_t batch = 0;
+        for (size_t j = 0; j < session.inflight_msg.msg_iovlen; j++) {
+            batch += session.inflight_iov[j].iov_len;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = session.sockfd;
+        sqe->addr = (uint64_t)(uintptr_t)&session.inflight_msg;
+        sqe->len = 1;
+        // Like TCP_CORK: when the rest of the queue follows right after, don't push out a part-filled segment
+        sqe->msg_flags = MSG_NOSIGNAL | (session.inflight_count < session.outq.size() ? MSG_MORE : 0);
+        sqe->user_data = uringUserData(URING_SEND, session.sockfd, session.generation);
+        // v2 frame headers live in the queue itself, which a zero-copy send may outlive
+        if (reactor.zerocopy && session.proto != PROTO_V2 && batch >= zerocopy_min) {
+            // The pin outlives the session if need be; it is freed by the notification that ends the send
+            ZeroCopyPin *pin = new ZeroCopyPin;
+            pin->sockfd = session.sockfd;
+            pin->generation = session.generation;
+            pinOutput(session, batch, pin->bufs);
+            sqe->opcode = IORING_OP_SENDMSG_ZC;
+            sqe->user_data = ((uint64_t)URING_SEND_ZC << 56) | (uint64_t)(uintptr_t)pin;
+        }
+    }
+    reactor.dirty.clear();
+}
+
+/*
+ * Function: uringFinishClose
+ * Purpose: To forget a client and close its socket once nothing of it is left in the ring but the cancelled recv
+ * Parameters: The event loop, and the socket descriptor
+*/
+static void uringFinishClose(Reactor &reactor, int sockfd) {
+    reactor.sessions.erase(sockfd);
+    close(sockfd);
+}
+
+/*
+ * Function: uringCancel
+ * Purpose: To cancel a client's multishot recv, or with everything set every request on its socket
+ * Parameters: The event loop, the client, and whether to cancel its send as well
+*/
+static void uringCancel(Reactor &reactor, const ClientSession &session, bool everything) {
+    struct io_uring_sqe *sqe = uringGetSqe(reactor);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    if (everything) {
+        sqe->fd = session.sockfd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    else {
+        sqe->addr = uringUserData(URING_RECV, session.sockfd, session.generation);
+    }
+    sqe->user_data = uringUserData(URING_CANCEL, session.sockfd, session.generation);
+}
+
+/*
+ * Function: uringCloseClient
+ * Purpose: To stop receiving from a client and close it after its last replies have gone out.
+ *          A client cut off by the slow-consumer policy is not waited for.
+ * Parameters: The event loop, and the socket descriptor
+*/
+static void uringCloseClient(Reactor &reactor, int sockfd) {
+    std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(sockfd);
+    if (it == reactor.sessions.end() || it->second.closing) {
+        return;
+    }
+    ClientSession &session = it->second;
+    session.closing = true;
+
+    // The send still points into the session, so it has to complete (cancelled) before the session goes
+    uringCancel(reactor, session, session.evicting && session.send_inflight);
+    if (!session.send_inflight && (session.out_bytes == 0 || session.evicting)) {
+        uringFinishClose(reactor, sockfd);
+    }
+}
+
+/*
+ * Function: uringSendDone
+ * Purpose: To account for a finished send, resuming a short write or submitting replies queued meanwhile
+ * Parameters: The event loop, the client, and the result of the send
+*/
+static void uringSendDone(Reactor &reactor, ClientSession &session, int res) {
+    session.send_inflight = false;
+    if (res < 0 && !session.resume_token.empty() && !session.closing) {
+        // Kept for the client to resume; the recv notices the connection is gone
+        return;
+    }
+    if (res < 0) {
+        if (!session.evicting) {
+            std::cerr << "Failed to send message to client socket: " << session.sockfd << std::endl;
+        }
+        discardOutput(session);
+    }
+    else {
+        // A short write leaves the rest at the front of the queue for the next send
+        consumeOutput(session, res);
+    }
+
+    if (session.out_bytes > 0 && !session.evicting) {
+        markDirty(reactor, session);
+    }
+    else if (session.closing) {
+        uringFinishClose(reactor, session.sockfd);
+    }
+}
+
+
+/*
+ * Function: takeBuffer
+ * Purpose: To get an empty buffer to format a message in. The event loop keeps the buffers of earlier messages
+ *          and hands one out again once it holds the only reference left, that is once every queue the message
+ *          went to has sent it, so relaying a message does not allocate.
+ * Parameters: The event loop
+ * Returns: The buffer, which may be written until it is queued
+*/
+static std::shared_ptr<std::string> takeBuffer(Reactor &reactor) {
+    std::vector<std::shared_ptr<std::string> > &pool = reactor.buffer_pool;
+    for (size_t i = 0; i < pool.size() && i < MESSAGE_POOL_PROBE; i++) {
+        std::shared_ptr<std::string> &buffer = pool[reactor.buffer_next];
+        reactor.buffer_next = (reactor.buffer_next + 1) % pool.size();
+        if (buffer.use_count() == 1) {
+            // The last queue may have let go on another thread; make sure it is done reading
+            std::atomic_thread_fence(std::memory_order_acquire);
+            buffer->clear();
+            return buffer;
+        }
+    }
+    std::shared_ptr<std::string> buffer = std::make_shared<std::string>();
+    // Room for any one command's worth, so a buffer seldom grows once it is in the pool
+    buffer->reserve(BUF_SIZE);
+    if (pool.size() < MESSAGE_POOL_SIZE) {
+        pool.push_back(buffer);
+    }
+    return buffer;
+}
+
+/*
+ * Function: sendLocal
+ * Purpose: To queue a reply for a client owned by the given event loop. Nothing is written here; the loop
+ *          flushes every queue it touched once the current iteration's handlers are done, with one gathered
+ *          write per client. Small replies other than public chat are copied into a batch buffer, so a
+ *          client that pipelines hundreds of commands still gets all its answers in that one write.
+ * Parameters: The event loop, the socket descriptor, the message, and what kind of reply it is
+*/
+static ssize_t sendLocal(Reactor &reactor, int sockfd, const SharedMessage& message, ReplyKind kind) {
+    std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(sockfd);
+    if (it == reactor.sessions.end() || it->second.closing || it->second.evicting) {
+        return -1;
+    }
+    ClientSession &session = it->second;
+
+    // Public chat stays a reply of its own so the slow-consumer policy can still shed it
+    if (kind != REPLY_PUBLIC && message->size() <= BATCH_SMALL_REPLY) {
+        size_t framed = message->size() + (session.proto == PROTO_V2 ? V2_HEADER_SIZE : 0);
+        if (session.outq.empty() || session.outq.back().batch == NULL ||
+            session.outq.back().batch->size() + framed > BATCH_BUFFER_MAX) {
+            std::shared_ptr<std::string> batch = takeBuffer(reactor);
+            session.outq.push_back(OutMessage());
+            session.outq.back().data = batch;
+            session.outq.back().batch = batch.get();
+            session.outq.back().kind = REPLY_DIRECT;
+            session.outq.back().queued_ms = reactor.now_ms;
+        }
+        std::string &batch = *session.outq.back().batch;
+        if (session.proto == PROTO_V2) {
+            unsigned char header[V2_HEADER_SIZE];
+            frameHeader(session, kind, message->size(), header);
+            batch.append((const char *)header, V2_HEADER_SIZE);
+        }
+        batch += *message;
+        session.out_bytes += framed;
+        shedOutput(session, reactor.now_ms);
+        markDirty(reactor, session);
+        return message->size();
+    }
+
+    session.outq.push_back(OutMessage());
+    session.outq.back().data = message;
+    session.outq.back().kind = kind;
+    session.outq.back().queued_ms = reactor.now_ms;
+    frameReply(session, session.outq.back());
+    session.out_bytes += outSize(session.outq.back());
+    shedOutput(session, reactor.now_ms);
+    markDirty(reactor, session);
+    return message->size();
+}
+
+/*
+ * Function: mailboxPush
+ * Purpose: To leave a reply in an event loop's mailbox and wake the loop if it is not already due to look
+ * Parameters: The event loop, and the reply
+*/
+static void mailboxPush(Reactor &reactor, RemoteReply &reply) {
+    Mailbox &mailbox = reactor.mailbox;
+    bool queued = false;
+    if (!mailbox.overflowing.load()) {
+        size_t pos = mailbox.enqueue_pos.load(std::memory_order_relaxed);
+        for ( ; ; ) {
+            MailSlot &slot = mailbox.slots[pos & (MAILBOX_SLOTS - 1)];
+            intptr_t turn = (intptr_t)slot.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+            if (turn == 0) {
+                // The slot is free; claim it unless another sender got there first
+                if (mailbox.enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.reply = std::move(reply);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    queued = true;
+                    break;
+                }
+            }
+            else if (turn < 0) {
+                // Full: the owner has not taken the reply from a lap ago yet
+                break;
+            }
+            else {
+                pos = mailbox.enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    if (!queued) {
+        std::lock_guard<std::mutex> lock(mailbox.overflow_mutex);
+        mailbox.overflowing.store(true);
+        mailbox.overflow.push_back(std::move(reply));
+    }
+
+    if (!mailbox.wake_pending.exchange(true)) {
+        uint64_t one = 1;
+        if (write(reactor.wake_fd, &one, sizeof one) < 0 && errno != EAGAIN) {
+            std::cerr << "Failed to wake event loop " << reactor.index << std::endl;
+        }
+    }
+}
+
+/*
+ * Function: sendToSession
+ * Purpose: To send a reply to a client. Replies for clients of this thread's event loop go straight into their
+ *          queue; clients of another loop get the reply through that loop's mailbox, so a socket is only ever
+ *          written by its owner and the caller never waits on a slow reader. Only the reference is queued,
+ *          so a broadcast hands every recipient the same buffer.
+ * Parameters: The socket descriptor, the session generation it must still belong to (0 for whoever has it),
+ *             the message, and whether it is public chat a slow client may lose
+ * Returns: The bytes queued, 0 if that session is gone, -1 on error
+*/
+static ssize_t sendToSession(int sockfd, unsigned generation, const SharedMessage& message, ReplyKind kind) {
+    if (sockfd < 0 || (size_t)sockfd >= fd_owners_size) {
+        return -1;
+    }
+    uint64_t owner = fd_owners[sockfd].load(std::memory_order_acquire);
+    // A roster being read may still list a client that left since, maybe with its descriptor reused
+    if (generation != 0 && (unsigned)owner != generation) {
+        return 0;
+    }
+    if (owner == 0) {
+        return -1;
+    }
+    Reactor *reactor = reactors[(owner >> 32) - 1];
+    if (reactor == current_reactor) {
+        return sendLocal(*reactor, sockfd, message, kind);
+    }
+
+    RemoteReply reply;
+    reply.sockfd = sockfd;
+    reply.generation = (unsigned)owner;
+    reply.kind = kind;
+    reply.message = message;
+    mailboxPush(*reactor, reply);
+    return message->size();
+}
+
+/*
+ * Function: sendToClient
+ * Purpose: To send a reply to whichever client has the socket now
+ * Parameters: The socket descriptor, the message, and whether it is public chat a slow client may lose
+*/
+static ssize_t sendToClient(int sockfd, const SharedMessage& message, ReplyKind kind = REPLY_DIRECT) {
+    return sendToSession(sockfd, 0, message, kind);
+}
+
+/*
+ * Function: sendToClient
+ * Purpose: To send a reply meant for one client only
+ * Parameters: The socket descriptor, the message, and whether it is public chat a slow client may lose
+*/
+static ssize_t sendToClient(int sockfd, const std::string& message, ReplyKind kind = REPLY_DIRECT) {
+    return sendToClient(sockfd, std::make_shared<const std::string>(message), kind);
+}
+
+/*
+ * Function: fanOutLocal
+ * Purpose: To queue a broadcast for the clients of one event loop. Only the roster slots, or for a room the
+ *          members, this loop owns (by the owner table, and still in the session they registered or joined
+ *          with) are taken; a slot handed over by RESUME is taken before the new connection learns its user.
+ * Parameters: The event loop, the room's members (NULL for every registered client), the message, what kind
+ *             of reply it is, the socket descriptor to skip, and for a join or leave, the delta form of it
+*/
+static void fanOutLocal(Reactor &reactor, const RoomMembers *members, const SharedMessage& message, ReplyKind kind,
+                        int skip_sockfd, const SharedMessage& delta) {
+    uint64_t mine = (uint64_t)(reactor.index + 1) << 32;
+    if (members == NULL) {
+        uint32_t size = roster_size.load();
+        for (uint32_t id = 0; id < size; id++) {
+            const RosterEntry &client = rosterEntry(id);
+            int sockfd = client.sockfd.load();
+            if (sockfd >= 0 && (size_t)sockfd < fd_owners_size && sockfd != skip_sockfd &&
+                fd_owners[sockfd].load(std::memory_order_acquire) == (mine | client.generation)) {
+                sendLocal(reactor, sockfd, delta && client.deltas ? delta : message, kind);
+            }
+        }
+        return;
+    }
+    for (size_t i = 0; i < members->size(); i++) {
+        const RoomMember &member = (*members)[i];
+        if (member.sockfd != skip_sockfd && (size_t)member.sockfd < fd_owners_size &&
+            fd_owners[member.sockfd].load(std::memory_order_acquire) == (mine | member.generation)) {
+            sendLocal(reactor, member.sockfd, message, kind);
+        }
+    }
+}
+
+/*
+ * Function: fanOut
+ * Purpose: To deliver a broadcast with a large audience. Every other event loop gets one mailbox entry and
+ *          queues the message for its own clients, all loops at once, while this loop does its own share; the
+ *          sender's time no longer grows with the audience. Each loop's mailbox is in order, so a client still
+ *          gets one sender's messages in the order they were sent.
+ * Parameters: The room's members (NULL for every registered client), the message, what kind of reply it is,
+ *             the socket descriptor to skip, and for a join or leave, the delta form of it
+*/
+static void fanOut(const std::shared_ptr<const RoomMembers>& members, const SharedMessage& message, ReplyKind kind,
+                   int skip_sockfd, const SharedMessage& delta = SharedMessage()) {
+    fanouts++;
+    for (size_t i = 0; i < reactors.size(); i++) {
+        if (reactors[i] != current_reactor) {
+            RemoteReply reply;
+            reply.sockfd = -1;
+            reply.generation = 0;
+            reply.kind = kind;
+            reply.message = message;
+            reply.delta = delta;
+            reply.room = members;
+            mailboxPush(*reactors[i], reply);
+        }
+    }
+    fanOutLocal(*current_reactor, members.get(), message, kind, skip_sockfd, delta);
+}
+
+/*
+ * Function: fanOutWanted
+ * Purpose: To tell whether a broadcast to this many recipients should be handed to every event loop
+ * Parameters: The number of recipients
+*/
+static bool fanOutWanted(size_t audience) {
+    return reactors.size() > 1 && fanout_min > 0 && audience >= fanout_min;
+}
+
+// Defined with the rest of RESUME, further down
+static void handleResume(Reactor &reactor, int sockfd, unsigned generation, const std::shared_ptr<ResumeState>& state);
+
+/*
+ * Function: deliverRemote
+ * Purpose: To queue a reply another event loop left for one of this loop's clients
+ * Parameters: The event loop, and the reply
+*/
+static void deliverRemote(Reactor &reactor, const RemoteReply &reply) {
+    if (reply.resume) {
+        handleResume(reactor, reply.sockfd, reply.generation, reply.resume);
+        return;
+    }
+    if (reply.sockfd < 0) {
+        fanOutLocal(reactor, reply.room.get(), reply.message, reply.kind, -1, reply.delta);
+        return;
+    }
+    std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(reply.sockfd);
+    // Skip clients that left, or whose descriptor now belongs to someone else
+    if (it == reactor.sessions.end() || it->second.generation != reply.generation || it->second.closing) {
+        return;
+    }
+    sendLocal(reactor, reply.sockfd, reply.message, reply.kind);
+}
+
+/*
+ * Function: drainMailbox
+ * Purpose: To deliver the replies other event loops left for this loop's clients. At most one ring's worth is
+ *          taken per call, so a flood from other loops cannot keep this one from its own sockets.
+ * Parameters: The event loop
+*/
+static void drainMailbox(Reactor &reactor) {
+    Mailbox &mailbox = reactor.mailbox;
+    // Senders from now on wake us again
+    mailbox.wake_pending.store(false);
+
+    for (size_t taken = 0; taken < MAILBOX_SLOTS; taken++) {
+        MailSlot &slot = mailbox.slots[mailbox.dequeue_pos & (MAILBOX_SLOTS - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != mailbox.dequeue_pos + 1) {
+            break;
+        }
+        RemoteReply reply = std::move(slot.reply);
+        slot.seq.store(mailbox.dequeue_pos + MAILBOX_SLOTS, std::memory_order_release);
+        mailbox.dequeue_pos++;
+        deliverRemote(reactor, reply);
+    }
+
+    bool more = mailbox.slots[mailbox.dequeue_pos & (MAILBOX_SLOTS - 1)].seq.load(std::memory_order_acquire) ==
+                mailbox.dequeue_pos + 1;
+    // The overflow list is only taken once the ring is empty, since anything in it was sent after the ring filled
+    if (!more && mailbox.overflowing.load()) {
+        std::vector<RemoteReply> replies;
+        {
+            std::lock_guard<std::mutex> lock(mailbox.overflow_mutex);
+            replies.swap(mailbox.overflow);
+            mailbox.overflowing.store(false);
+        }
+        for (size_t i = 0; i < replies.size(); i++) {
+            deliverRemote(reactor, replies[i]);
+        }
+    }
+    if (more && !mailbox.wake_pending.exchange(true)) {
+        uint64_t one = 1;
+        if (write(reactor.wake_fd, &one, sizeof one) < 0 && errno != EAGAIN) {
+            std::cerr << "Failed to wake event loop " << reactor.index << std::endl;
+        }
+    }
+}
+
+/*
+ * Function: adoptClient
+ * Purpose: To make a freshly accepted client part of an event loop and record the loop as its owner
+ * Parameters: The event loop, and the new client
+ * Returns: The stored session, or NULL if the descriptor cannot be tracked
+*/
+static ClientSession *adoptClient(Reactor &reactor, ClientSession &session) {
+    if ((size_t)session.sockfd >= fd_owners_size) {
+        return NULL;
+    }
+    session.generation = ++session_generation;
+    ClientSession &stored = reactor.sessions[session.sockfd] = session;
+    fd_owners[session.sockfd].store(((uint64_t)(reactor.index + 1) << 32) | session.generation,
+                                    std::memory_order_release);
+    return &stored;
+}
+
+/*
+ * Function: sessionOf
+ * Purpose: To find a client of this thread's event loop
+ * Parameters: The socket descriptor
+ * Returns: The session, or NULL
+*/
+static ClientSession *sessionOf(int sockfd) {
+    std::unordered_map<int, ClientSession>::iterator it = current_reactor->sessions.find(sockfd);
+    return it == current_reactor->sessions.end() ? NULL : &it->second;
+}
+
+/*
+ * Function: nameOf
+ * Purpose: To find the username registered on a socket of this thread's event loop, where it is stored (empty
+ *          if the client has not registered). Only the client's own loop can make it leave, so the name stays
+ *          put for as long as the caller's handler runs.
+ * Parameters: The socket descriptor
+*/
+static const RosterName &nameOf(int sockfd) {
+    static const RosterName unregistered = {0, {0}};
+    ClientSession *session = sessionOf(sockfd);
+    if (session == NULL || session->user_id == NO_USER) {
+        return unregistered;
+    }
+    return rosterName(session->user_id);
+}
+
+/*
+ * Function: usernameOf
+ * Purpose: To look up the username registered on a socket (empty if the client has not registered)
+ * Parameters: The socket descriptor
+*/
+static std::string usernameOf(int sockfd) {
+    const RosterName &name = nameOf(sockfd);
+    return std::string(name.text, name.len);
+}
+
+/*
+ * Function: shardOf
+ * Purpose: To find the registry shard a username or client address belongs to
+ * Parameters: The username or address
+*/
+static size_t shardOf(const std::string& key) {
+    return registryHash(key.data(), key.size()) % REGISTRY_SHARDS;
+}
+
+/*
+ * Class: ShardLock
+ * Purpose: Holds up to three registry shards at once. They are always taken in index order, so two threads
+ *          that need overlapping shards cannot deadlock.
+*/
+class ShardLock {
+public:
+    ShardLock(size_t a, size_t b, size_t c = REGISTRY_SHARDS) : count(0) {
+        size_t wanted[3] = {a, b, c};
+        std::sort(wanted, wanted + 3);
+        for (int i = 0; i < 3; i++) {
+            if (wanted[i] < REGISTRY_SHARDS && (count == 0 || shards[count - 1] != wanted[i])) {
+                shards[count++] = wanted[i];
+                registry_shards[wanted[i]].mutex.lock();
+            }
+        }
+    }
+    ~ShardLock() {
+        while (count > 0) {
+            registry_shards[shards[--count]].mutex.unlock();
+        }
+    }
+private:
+    size_t shards[3];
+    size_t count;
+};
+
+/*
+ * Function: lockAllShards / unlockAllShards
+ * Purpose: To stop every registry change, for compaction to take a consistent copy or swap in a new snapshot
+*/
+static void lockAllShards() {
+    for (size_t i = 0; i < REGISTRY_SHARDS; i++) {
+        registry_shards[i].mutex.lock();
+    }
+}
+
+static void unlockAllShards() {
+    for (size_t i = REGISTRY_SHARDS; i-- > 0; ) {
+        registry_shards[i].mutex.unlock();
+    }
+}
+
+/*
+ * Function: writeAll
+ * Purpose: To write a whole buffer to a file, however many calls it takes
+ * Parameters: The file descriptor, the data, and its length
+*/
+static bool writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+/*
+ * Function: openOfflineSpill
+ * Purpose: To create the spill file of the offline mailboxes and map it. The file is sparse, so it only takes
+ *          disk space for blocks that were written, and the kernel may write its pages out and drop them from
+ *          memory. Without it, messages over the memory budget are turned away.
+*/
+static void openOfflineSpill() {
+    int fd = open(OFFLINE_SPILL_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || unlink(OFFLINE_SPILL_FILE) < 0 || ftruncate(fd, OFFLINE_SPILL_BYTES) < 0) {
+        std::cerr << "Error creating " << OFFLINE_SPILL_FILE << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    void *map = mmap(NULL, OFFLINE_SPILL_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "Error mapping " << OFFLINE_SPILL_FILE << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    offline_spill = (char *)map;
+}
+
+/*
+ * Function: spillMessage
+ * Purpose: To copy a message into free blocks of the spill file
+ * Parameters: The message, and where to list the blocks it went to
+ * Returns: false if the file is full (or there is none)
+*/
+static bool spillMessage(const std::string& message, std::vector<uint32_t> &blocks) {
+    size_t count = (message.size() + OFFLINE_BLOCK - 1) / OFFLINE_BLOCK;
+    {
+        std::lock_guard<std::mutex> lock(offline_spill_mutex);
+        if (offline_spill == NULL || count > offline_spill_free.size() + (OFFLINE_SPILL_BYTES / OFFLINE_BLOCK - offline_spill_top)) {
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (!offline_spill_free.empty()) {
+                blocks.push_back(offline_spill_free.back());
+                offline_spill_free.pop_back();
+            }
+            else {
+                blocks.push_back(offline_spill_top++);
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t offset = i * OFFLINE_BLOCK;
+        memcpy(offline_spill + (size_t)blocks[i] * OFFLINE_BLOCK, message.data() + offset,
+               std::min<size_t>(OFFLINE_BLOCK, message.size() - offset));
+    }
+    return true;
+}
+
+/*
+ * Function: releaseOffline
+ * Purpose: To give back the memory or the spill file blocks a kept message takes
+ * Parameters: The message
+*/
+static void releaseOffline(OfflineMessage &message) {
+    if (message.text) {
+        offline_memory_used -= message.length;
+        message.text.reset();
+        return;
+    }
+    std::lock_guard<std::mutex> lock(offline_spill_mutex);
+    offline_spill_free.insert(offline_spill_free.end(), message.blocks.begin(), message.blocks.end());
+    message.blocks.clear();
+}
+
+/*
+ * Function: storeOffline
+ * Purpose: To keep a private message for a registered user who is not connected. Call with the user's shard held.
+ * Parameters: The user's shard, the username, and the message as it would have been sent
+ * Returns: false if the user's mailbox is full, or there is no room left in memory or in the spill file
+*/
+static bool storeOffline(RegistryShard &shard, const std::string& username, const SharedMessage& message) {
+    std::deque<OfflineMessage> &box = shard.offline[username];
+    if (box.size() >= OFFLINE_MAX_MESSAGES) {
+        offline_refused++;
+        return false;
+    }
+    OfflineMessage kept;
+    kept.length = message->size();
+    if (offline_memory_used.fetch_add(kept.length) + kept.length <= offline_memory_budget) {
+        // A copy of its own, so the event loop's buffer can go back to its pool
+        kept.text = std::make_shared<const std::string>(*message);
+    }
+    else {
+        offline_memory_used -= kept.length;
+        if (!spillMessage(*message, kept.blocks)) {
+            if (box.empty()) {
+                shard.offline.erase(username);
+            }
+            offline_refused++;
+            return false;
+        }
+        offline_spilled++;
+    }
+    box.push_back(std::move(kept));
+    offline_stored++;
+    return true;
+}
+
+/*
+ * Function: dropOffline
+ * Purpose: To throw away a user's mailbox, once the name is no longer theirs. Call with the user's shard held.
+ * Parameters: The user's shard, and the username
+*/
+static void dropOffline(RegistryShard &shard, const std::string& username) {
+    std::unordered_map<std::string, std::deque<OfflineMessage> >::iterator it = shard.offline.find(username);
+    if (it == shard.offline.end()) {
+        return;
+    }
+    for (size_t i = 0; i < it->second.size(); i++) {
+        releaseOffline(it->second[i]);
+    }
+    shard.offline.erase(it);
+}
+
+/*
+ * Function: deliverOffline
+ * Purpose: To hand a user who came back the private messages kept for them, oldest first. They are queued
+ *          together, so they go out with the rest of this loop iteration's replies in one gathered write.
+ * Parameters: The client, and its username
+*/
+static void deliverOffline(int sockfd, const std::string& username) {
+    std::deque<OfflineMessage> box;
+    {
+        RegistryShard &shard = registry_shards[shardOf(username)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::unordered_map<std::string, std::deque<OfflineMessage> >::iterator it = shard.offline.find(username);
+        if (it == shard.offline.end()) {
+            return;
+        }
+        box.swap(it->second);
+        shard.offline.erase(it);
+    }
+    for (size_t i = 0; i < box.size(); i++) {
+        OfflineMessage &kept = box[i];
+        if (kept.text) {
+            sendToClient(sockfd, kept.text, REPLY_PRIVATE);
+        }
+        else {
+            std::string text;
+            text.reserve(kept.length);
+            for (size_t b = 0; b < kept.blocks.size(); b++) {
+                text.append(offline_spill + (size_t)kept.blocks[b] * OFFLINE_BLOCK,
+                            std::min<size_t>(OFFLINE_BLOCK, kept.length - b * OFFLINE_BLOCK));
+            }
+            sendToClient(sockfd, text, REPLY_PRIVATE);
+        }
+        releaseOffline(kept);
+        offline_delivered++;
+    }
+}
+
+/*
+ * Function: baseHasUser
+ * Purpose: To check whether the snapshot holds a username that is still registered.
+ *          Call with the username's shard held.
+ * Parameters: The username
+*/
+static bool baseHasUser(const std::string& username) {
+    return registryFindName(registry_base, username) != NULL &&
+           registry_shards[shardOf(username)].shadowed.count(username) == 0;
+}
+
+/*
+ * Function: baseHasAddr
+ * Purpose: To check whether the snapshot holds a client address whose user is still registered.
+ *          Call with the address's shard held.
+ * Parameters: The client address
+*/
+static bool baseHasAddr(const std::string& client_ipaddress) {
+    return registryFindAddr(registry_base, client_ipaddress) != NULL &&
+           registry_shards[shardOf(client_ipaddress)].shadowed_addrs.count(client_ipaddress) == 0;
+}
+
+/*
+ * Function: baseAddrOf
+ * Purpose: To find the address a username has in the snapshot (empty if it is not there)
+ * Parameters: The username
+*/
+static std::string baseAddrOf(const std::string& username) {
+    const RegistryRecord *record = registryFindName(registry_base, username);
+    return record == NULL ? std::string() : registryString(registry_base, record->addr_off, record->addr_len);
+}
+
+/*
+ * Function: forgetUser
+ * Purpose: To take a user out of the registry: out of memory, and hidden in the snapshot if it is there.
+ *          Call with the shards of the username, its address, and its snapshot address held.
+ * Parameters: The username
+ * Returns: false if the user was not registered
+*/
+static bool forgetUser(const std::string& username) {
+    RegistryShard &shard = registry_shards[shardOf(username)];
+    bool registered = false;
+    std::unordered_map<std::string, Registration>::iterator it = shard.by_name.find(username);
+    if (it != shard.by_name.end()) {
+        registry_shards[shardOf(it->second.addr)].by_addr.erase(it->second.addr);
+        shard.by_name.erase(it);
+        registered = true;
+    }
+    dropOffline(shard, username);
+    // A user the last snapshot was taken with stays in it until the next one, hidden
+    if (registryFindName(registry_base, username) != NULL && shard.shadowed.insert(username).second) {
+        std::string base_addr = baseAddrOf(username);
+        registry_shards[shardOf(base_addr)].shadowed_addrs.insert(base_addr);
+        registered = true;
+    }
+    return registered;
+}
+
+/*
+ * Function: loadRegistry
+ * Purpose: To bring back the users registered in an earlier run, so they stay taken. The snapshot is only
+ *          mapped; the log holds the changes made after it was written, "+ username address" for a
+ *          registration and "- username" for a user leaving, and is replayed into memory. Runs before any
+ *          other thread starts, so it takes no locks.
+ * Parameters: Set to true when the registry came from the old text file and still needs a snapshot
+ * Returns: How many log records were replayed, or -1 if the snapshot is damaged
+*/
+static long loadRegistry(bool &legacy) {
+    std::string line;
+    legacy = false;
+    int fd = open(REGISTRY_SNAPSHOT, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        bool mapped = registryMap(fd, registry_base);
+        close(fd);
+        if (!mapped) {
+            std::cerr << REGISTRY_SNAPSHOT << " is not a registry snapshot" << std::endl;
+            return -1;
+        }
+    }
+    else {
+        // One "username address" line per user
+        std::ifstream REG_USERS(REGISTRY_LEGACY);
+        // File does not exist; no usernames are registered yet.
+        while (REG_USERS.is_open() && std::getline(REG_USERS, line)) {
+            std::istringstream iss(line);
+            std::string username, stored_ipaddress;
+            iss >> username >> stored_ipaddress;
+            if (username.empty()) {
+                continue;
+            }
+            Registration registration = {stored_ipaddress, -1, 0};
+            registry_shards[shardOf(username)].by_name.insert(std::make_pair(username, registration));
+            registry_shards[shardOf(stored_ipaddress)].by_addr.insert(std::make_pair(stored_ipaddress, username));
+            legacy = true;
+        }
+    }
+
+    std::ifstream REG_LOG(REGISTRY_LOG);
+    long records = 0;
+    while (REG_LOG.is_open() && std::getline(REG_LOG, line)) {
+        // A record cut short by a crash has no newline, and is left out
+        if (REG_LOG.eof()) {
+            break;
+        }
+        std::istringstream iss(line);
+        std::string op, username, stored_ipaddress;
+        iss >> op >> username >> stored_ipaddress;
+        if (op == "+") {
+            Registration registration = {stored_ipaddress, -1, 0};
+            registry_shards[shardOf(username)].by_name[username] = registration;
+            registry_shards[shardOf(stored_ipaddress)].by_addr[stored_ipaddress] = username;
+        }
+        else if (op == "-") {
+            forgetUser(username);
+        }
+        records++;
+    }
+    return records;
+}
+
+/*
+ * Function: registryAppend
+ * Purpose: To hand a registry record to the writer thread. Called with the shards of the user held, so the
+ *          records for any one username or address reach the log in the order the changes were made.
+ * Parameters: The record, newline included
+*/
+static void registryAppend(const std::string& record) {
+    std::lock_guard<std::mutex> lock(registry_log_mutex);
+    registry_log_pending += record;
+    registry_log_pending_records++;
+    registry_log_ready.notify_one();
+}
+
+/*
+ * Function: compactRegistry
+ * Purpose: To fold the log into a new snapshot and start the log over. The users in memory are copied in the
+ *          same critical section that takes the records still waiting, so the snapshot covers exactly those
+ *          records and anything added afterwards goes to the emptied log. The old snapshot is merged in
+ *          outside the lock; it never changes, and only this thread replaces it.
+ * Returns: false if the new snapshot could not be written
+*/
+static bool compactRegistry() {
+    std::vector<std::pair<std::string, std::string> > users;
+    std::unordered_set<std::string> skip;
+    RegistrySnapshot base;
+    std::string pending;
+    size_t pending_records;
+    lockAllShards();
+    {
+        std::lock_guard<std::mutex> log_lock(registry_log_mutex);
+        for (size_t i = 0; i < REGISTRY_SHARDS; i++) {
+            const RegistryShard &shard = registry_shards[i];
+            for (std::unordered_map<std::string, Registration>::const_iterator it = shard.by_name.begin(); it != shard.by_name.end(); ++it) {
+                users.push_back(std::make_pair(it->first, it->second.addr));
+                skip.insert(it->first);
+            }
+            skip.insert(shard.shadowed.begin(), shard.shadowed.end());
+        }
+        base = registry_base;
+        pending.swap(registry_log_pending);
+        pending_records = registry_log_pending_records;
+        registry_log_pending_records = 0;
+    }
+    unlockAllShards();
+
+    // The waiting records go to the old log first, in case the snapshot cannot be written
+    if (!writeAll(registry_log_fd, pending.data(), pending.size())) {
+        std::cerr << "Error writing " << REGISTRY_LOG << ": " << strerror(errno) << std::endl;
+    }
+    registry_log_records += pending_records;
+
+    if (base.map != NULL) {
+        for (uint32_t i = 0; i < base.header->name_slots; i++) {
+            const RegistryRecord &record = base.names[i];
+            if (record.name_len == 0) {
+                continue;
+            }
+            std::string username = registryString(base, record.name_off, record.name_len);
+            if (!username.empty() && skip.count(username) == 0) {
+                users.push_back(std::make_pair(username, registryString(base, record.addr_off, record.addr_len)));
+            }
+        }
+    }
+    std::string snapshot = registryBuild(users);
+
+    std::string temporary = std::string(REGISTRY_SNAPSHOT) + ".tmp";
+    int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    RegistrySnapshot fresh;
+    if (fd < 0 || !writeAll(fd, snapshot.data(), snapshot.size()) || fdatasync(fd) < 0 || !registryMap(fd, fresh)) {
+        std::cerr << "Error writing " << temporary << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    close(fd);
+    if (rename(temporary.c_str(), REGISTRY_SNAPSHOT) < 0) {
+        std::cerr << "Error replacing " << REGISTRY_SNAPSHOT << ": " << strerror(errno) << std::endl;
+        registryUnmap(fresh);
+        return false;
+    }
+
+    lockAllShards();
+    registry_base = fresh;
+    std::vector<std::string> shadowed;
+    for (size_t i = 0; i < REGISTRY_SHARDS; i++) {
+        RegistryShard &shard = registry_shards[i];
+        // Users replayed from the last run's log are in the snapshot now and need no memory of their own; names
+        // held for dropped clients stay, to run out
+        for (std::unordered_map<std::string, Registration>::iterator it = shard.by_name.begin(); it != shard.by_name.end(); ) {
+            if (it->second.sockfd < 0 && it->second.away_until == 0 && registryFindName(registry_base, it->first) != NULL) {
+                shard.shadowed.erase(it->first);
+                registry_shards[shardOf(it->second.addr)].by_addr.erase(it->second.addr);
+                it = shard.by_name.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        // A user who left only needs hiding if the new snapshot still has them, i.e. they left after the copy
+        for (std::unordered_set<std::string>::iterator it = shard.shadowed.begin(); it != shard.shadowed.end(); ) {
+            if (registryFindName(registry_base, *it) == NULL) {
+                it = shard.shadowed.erase(it);
+            }
+            else {
+                shadowed.push_back(*it);
+                ++it;
+            }
+        }
+    }
+    for (size_t i = 0; i < REGISTRY_SHARDS; i++) {
+        registry_shards[i].shadowed_addrs.clear();
+    }
+    for (size_t i = 0; i < shadowed.size(); i++) {
+        std::string base_addr = baseAddrOf(shadowed[i]);
+        registry_shards[shardOf(base_addr)].shadowed_addrs.insert(base_addr);
+    }
+    registryUnmap(base);
+    unlockAllShards();
+
+    // Replaying the old log over the new snapshot changes nothing, so a crash before this point is harmless
+    if (ftruncate(registry_log_fd, 0) < 0) {
+        std::cerr << "Error truncating " << REGISTRY_LOG << ": " << strerror(errno) << std::endl;
+        return true;
+    }
+    registry_log_records = 0;
+    registry_compactions++;
+    return true;
+}
+
+/*
+ * Function: registryWriter
+ * Purpose: The registry writer thread. It writes whatever records piled up while it was busy with one write
+ *          and one fdatasync (a group commit), so a burst of joins and leaves costs a few disk writes, not one
+ *          per client. Once the log is long enough it is compacted.
+*/
+static void registryWriter() {
+    for ( ; ; ) {
+        std::string batch;
+        size_t records;
+        {
+            std::unique_lock<std::mutex> lock(registry_log_mutex);
+            while (registry_log_pending.empty()) {
+                registry_log_ready.wait(lock);
+            }
+            batch.swap(registry_log_pending);
+            records = registry_log_pending_records;
+            registry_log_pending_records = 0;
+        }
+        if (!writeAll(registry_log_fd, batch.data(), batch.size()) || fdatasync(registry_log_fd) < 0) {
+            std::cerr << "Error writing " << REGISTRY_LOG << ": " << strerror(errno) << std::endl;
+        }
+        registry_log_records += records;
+        registry_commits++;
+
+        if (registry_log_records >= REGISTRY_COMPACT_RECORDS) {
+            compactRegistry();
+        }
+    }
+}
+
+/*
+ * Function: openRegistry
+ * Purpose: To load the registry and start the writer. Nothing here reads the snapshot through, so the server
+ *          is serving as soon as the (bounded) log is replayed.
+ * Returns: false if the registry cannot be used
+*/
+static bool openRegistry() {
+    bool legacy;
+    long replayed = loadRegistry(legacy);
+    if (replayed < 0) {
+        return false;
+    }
+    // O_APPEND, so writes land at the start again once compaction truncates it
+    registry_log_fd = open(REGISTRY_LOG, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (registry_log_fd < 0) {
+        std::cerr << "Error opening " << REGISTRY_LOG << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    registry_log_records = replayed;
+    // The old text file is read only this once
+    if (legacy) {
+        if (!compactRegistry()) {
+            return false;
+        }
+        unlink(REGISTRY_LEGACY);
+    }
+    // Started after main() blocks SIGUSR1, so the signal never lands on this thread
+    std::thread(registryWriter).detach();
+    return true;
+}
+
+/*
+ * Function: messageLog
+ * Purpose: To hand a relayed message to the message log. The record is only copied into this event loop's
+ *          pending buffer, under a lock no other loop takes; numbering, checksums and the disk are the writer
+ *          thread's business, and waking it is left to the end of the loop iteration.
+ * Parameters: What kind of message it is, the channel (room or recipient) and its length, and the message
+ *             as it was sent and its length
+*/
+static void messageLog(MessageLogKind kind, const char *channel, size_t channel_len, const char *message, size_t length) {
+    if (message_log_dir.empty()) {
+        return;
+    }
+    MessageLogRecord record;
+    memset(&record, 0, sizeof record);
+    record.length = channel_len + length;
+    record.kind = kind;
+    record.channel_len = channel_len;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.time_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    Reactor &reactor = *current_reactor;
+    {
+        std::lock_guard<std::mutex> lock(reactor.log_mutex);
+        if (reactor.log_pending.size() > MESSAGE_LOG_PENDING_MAX) {
+            message_log_dropped++;
+            return;
+        }
+        reactor.log_pending.append((const char *)&record, sizeof record).append(channel, channel_len).append(message, length);
+    }
+    reactor.log_wake = true;
+}
+
+/*
+ * Function: wakeMessageLog
+ * Purpose: To wake the message log writer, if it is asleep, once per loop iteration that left it records.
+ *          A burst of messages costs one wakeup, not one each.
+ * Parameters: The event loop
+*/
+static void wakeMessageLog(Reactor &reactor) {
+    if (!reactor.log_wake) {
+        return;
+    }
+    reactor.log_wake = false;
+    if (message_log_idle.load() && message_log_idle.exchange(false)) {
+        std::lock_guard<std::mutex> lock(message_log_wake_mutex);
+        message_log_wake.notify_one();
+    }
+}
+
+/*
+ * Function: syncDirectory
+ * Purpose: To make a file created in a directory survive a crash
+ * Parameters: The directory
+*/
+static void syncDirectory(const std::string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Function: openLogSegment
+ * Purpose: To close the current segment of the message log and start a new one with the next record
+ * Returns: false if the new segment could not be created
+*/
+static bool openLogSegment() {
+    std::string path = message_log_dir + "/" + msglogSegmentName(message_log_next_seq);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    MessageLogSegment header;
+    memcpy(header.magic, MSGLOG_MAGIC, 8);
+    header.first_seq = message_log_next_seq;
+    if (fd < 0 || !writeAll(fd, (const char *)&header, sizeof header) || fdatasync(fd) < 0) {
+        std::cerr << "Error creating " << path << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    syncDirectory(message_log_dir);
+    if (message_log_fd >= 0) {
+        close(message_log_fd);
+    }
+    message_log_fd = fd;
+    message_log_segment_size = sizeof header;
+    return true;
+}
+
+/*
+ * Function: messageLogWriter
+ * Purpose: The message log writer thread. It takes everything the event loops left it, numbers and checksums
+ *          the records in place, and writes them with one fdatasync for the lot (a group commit), so the
+ *          disk costs the same whether a commit holds one message or thousands. Commits are at least
+ *          MESSAGE_LOG_COMMIT_US apart, so under load a commit holds everything relayed in that time instead of
+ *          the writer syncing as fast as the disk allows and competing with the event loops for the CPU.
+ *          The buffers it takes are cleared and handed back on the next round, so none of this allocates once
+ *          they have grown.
+*/
+static void messageLogWriter() {
+    std::vector<std::string> batches(reactors.size());
+    for ( ; ; ) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < reactors.size(); i++) {
+            batches[i].clear();
+            std::lock_guard<std::mutex> lock(reactors[i]->log_mutex);
+            batches[i].swap(reactors[i]->log_pending);
+            bytes += batches[i].size();
+        }
+        if (bytes == 0) {
+            std::unique_lock<std::mutex> lock(message_log_wake_mutex);
+            message_log_idle.store(true);
+            // A loop that left a record before seeing the flag does not wake the writer, so look once more
+            bool empty = true;
+            for (size_t i = 0; i < reactors.size() && empty; i++) {
+                std::lock_guard<std::mutex> pending_lock(reactors[i]->log_mutex);
+                empty = reactors[i]->log_pending.empty();
+            }
+            while (empty && message_log_idle.load()) {
+                message_log_wake.wait(lock);
+            }
+            message_log_idle.store(false);
+            continue;
+        }
+
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        if (message_log_segment_size >= MESSAGE_LOG_SEGMENT_BYTES) {
+            openLogSegment();
+        }
+        uint64_t records = 0;
+        for (size_t i = 0; i < batches.size(); i++) {
+            std::string &batch = batches[i];
+            for (size_t offset = 0; offset < batch.size(); ) {
+                MessageLogRecord record;
+                memcpy(&record, &batch[offset], sizeof record);
+                record.seq = message_log_next_seq++;
+                record.crc = msglogRecordCrc(record, &batch[offset + sizeof record]);
+                memcpy(&batch[offset], &record, sizeof record);
+                offset += sizeof record + record.length;
+                records++;
+            }
+            if (!batch.empty() && !writeAll(message_log_fd, batch.data(), batch.size())) {
+                std::cerr << "Error writing the message log: " << strerror(errno) << std::endl;
+            }
+        }
+        if (fdatasync(message_log_fd) < 0) {
+            std::cerr << "Error writing the message log: " << strerror(errno) << std::endl;
+        }
+        message_log_segment_size += bytes;
+        message_log_records += records;
+        message_log_commits++;
+        std::this_thread::sleep_until(started + std::chrono::microseconds(MESSAGE_LOG_COMMIT_US));
+    }
+}
+
+/*
+ * Function: openMessageLog
+ * Purpose: To open the message log and start its writer. The newest segment is checked record by record; a
+ *          tail that does not check out, the last records of a crash, is cut off so the log goes on from the
+ *          last good record.
+ * Returns: false if the log cannot be used
+*/
+static bool openMessageLog() {
+    if (mkdir(message_log_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        std::cerr << "Error creating " << message_log_dir << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    DIR *dir = opendir(message_log_dir.c_str());
+    if (dir == NULL) {
+        std::cerr << "Error opening " << message_log_dir << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::string newest;
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() == 24 && name.compare(20, 4, ".log") == 0 &&
+            name.find_first_not_of("0123456789") == 20 && name > newest) {
+            newest = name;
+        }
+    }
+    closedir(dir);
+
+    if (!newest.empty()) {
+        std::string path = message_log_dir + "/" + newest;
+        int fd = open(path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            std::cerr << "Error opening " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        void *map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        MessageLogSegment header;
+        bool valid = map != MAP_FAILED && (size_t)st.st_size >= sizeof header;
+        if (valid) {
+            memcpy(&header, map, sizeof header);
+            valid = memcmp(header.magic, MSGLOG_MAGIC, 8) == 0;
+        }
+        if (!valid) {
+            std::cerr << "server: " << path << " is not a message log segment" << std::endl;
+            return false;
+        }
+        uint64_t seq = header.first_seq;
+        size_t good = sizeof header;
+        MessageLogRecord record;
+        for (size_t next; (next = msglogRecordAt((const char *)map, st.st_size, good, seq, record)) != 0; good = next) {
+            seq++;
+        }
+        munmap(map, st.st_size);
+        if (good < (size_t)st.st_size) {
+            std::cerr << "server: cutting " << st.st_size - good << " damaged bytes off the end of " << path << std::endl;
+            if (ftruncate(fd, good) < 0 || fdatasync(fd) < 0) {
+                std::cerr << "Error truncating " << path << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+        }
+        message_log_fd = fd;
+        message_log_segment_size = good;
+        message_log_next_seq = seq;
+    }
+    else if (!openLogSegment()) {
+        return false;
+    }
+    // Like the registry writer, started after main() blocks SIGUSR1
+    std::thread(messageLogWriter).detach();
+    return true;
+}
+
+/*
+ * Function: historyInit
+ * Purpose: To allocate a history ring, so that keeping a message never allocates
+ * Parameters: The ring, its size in bytes, and how many messages it keeps at most
+*/
+static void historyInit(HistoryRing &ring, size_t bytes, size_t messages) {
+    ring.bytes.resize(bytes);
+    ring.records.resize(messages);
+}
+
+/*
+ * Function: historyAppend
+ * Purpose: To keep a message in a channel's history, letting go of the oldest messages it writes over
+ * Parameters: The ring, and the message as it was sent
+*/
+static void historyAppend(HistoryRing &ring, const char *message, size_t length) {
+    uint32_t record_len = length + 1;
+    if (record_len > ring.bytes.size()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(ring.mutex);
+    size_t start = ring.write_pos;
+    size_t end = start + record_len;
+    // A message that does not fit before the end of the ring goes to its start, and the bytes after it are given up
+    bool wrapped = end > ring.bytes.size();
+    if (wrapped) {
+        end = record_len;
+        ring.write_pos = 0;
+    }
+    // The messages in the way are always the oldest ones
+    while (ring.first < ring.next) {
+        const HistoryRecord &oldest = ring.records[ring.first % ring.records.size()];
+        bool overwritten = wrapped ? (oldest.offset + oldest.length > start || oldest.offset < end)
+                                   : (oldest.offset < end && oldest.offset + oldest.length > start);
+        if (!overwritten && ring.next - ring.first < ring.records.size()) {
+            break;
+        }
+        ring.first++;
+    }
+    memcpy(&ring.bytes[ring.write_pos], message, length);
+    ring.bytes[ring.write_pos + length] = '\n';
+    HistoryRecord &record = ring.records[ring.next % ring.records.size()];
+    record.offset = ring.write_pos;
+    record.length = record_len;
+    ring.next++;
+    ring.write_pos += record_len;
+}
+
+/*
+ * Function: historyReplay
+ * Purpose: To get the last messages of a channel as one buffer, ready to be queued whole. The text is copied
+ *          out of the ring a run of bytes at a time, not formatted again, and the buffer is reused for every
+ *          client asking for the same number of messages until the next message arrives.
+ * Parameters: The ring, and how many messages
+ * Returns: The messages, or NULL if there are none
+*/
+static SharedMessage historyReplay(HistoryRing &ring, size_t count) {
+    std::lock_guard<std::mutex> lock(ring.mutex);
+    if (ring.replay && ring.replay_next == ring.next && ring.replay_count == count) {
+        return ring.replay;
+    }
+    uint64_t from = ring.next - std::min<uint64_t>(count, ring.next - ring.first);
+    if (from == ring.next) {
+        return SharedMessage();
+    }
+    std::shared_ptr<std::string> replay = std::make_shared<std::string>();
+    size_t run_start = ring.records[from % ring.records.size()].offset;
+    size_t run_end = run_start;
+    for (uint64_t n = from; n < ring.next; n++) {
+        const HistoryRecord &record = ring.records[n % ring.records.size()];
+        if (record.offset != run_end) {
+            replay->append(&ring.bytes[run_start], run_end - run_start);
+            run_start = record.offset;
+        }
+        run_end = record.offset + record.length;
+    }
+    replay->append(&ring.bytes[run_start], run_end - run_start);
+    ring.replay = replay;
+    ring.replay_count = count;
+    ring.replay_next = ring.next;
+    return replay;
+}
+
+/*
+ * Function: roomShardOf
+ * Purpose: To find the shard a room name belongs to
+ * Parameters: The room name and its length
+*/
+static RoomShard &roomShardOf(const char *name, size_t length) {
+    return room_shards[registryHash(name, length) % REGISTRY_SHARDS];
+}
+
+/*
+ * Function: retireRoom
+ * Purpose: To free a replaced member list, and a room whose last member left, once no event loop can still be
+ *          reading them. Whatever earlier retirements every loop has moved past is freed now.
+ * Parameters: The replaced list, and the emptied room (or NULL)
+*/
+static void retireRoom(const std::shared_ptr<const RoomMembers>& members, Room *room) {
+    std::lock_guard<std::mutex> lock(room_retired_mutex);
+    RetiredRoom retired = {members, room, ++roster_epoch};
+    room_retired.push_back(retired);
+
+    uint64_t oldest = ROSTER_OFFLINE;
+    for (size_t i = 0; i < reactors.size(); i++) {
+        oldest = std::min(oldest, reactors[i]->roster_seen.load());
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < room_retired.size(); i++) {
+        if (room_retired[i].epoch <= oldest) {
+            // A broadcast still on its way to other loops keeps its member list
+            room_retired[i].members.reset();
+            delete room_retired[i].room;
+        }
+        else {
+            room_retired[kept++] = room_retired[i];
+        }
+    }
+    room_retired.resize(kept);
+}
+
+/*
+ * Function: findRoom
+ * Purpose: To find one of the rooms a client is in by name. A client only ever sends to rooms it is in, so
+ *          its own short list is all that is searched, without a lock.
+ * Parameters: The client, and the room name and its length
+ * Returns: The room, or NULL
+*/
+static Room *findRoom(const ClientSession &session, const char *name, size_t length) {
+    for (size_t i = 0; i < session.rooms.size(); i++) {
+        const std::string &room_name = session.rooms[i]->name;
+        if (room_name.size() == length && memcmp(room_name.data(), name, length) == 0) {
+            return session.rooms[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: broadcastRoom
+ * Purpose: This function sends a message to every member of a room but one
+ * Parameters: The room, the message, what kind of reply it is, and the socket descriptor to skip
+*/
+static void broadcastRoom(const Room *room, const SharedMessage& message, ReplyKind kind, int sender_sockfd) {
+    // No lock: a list read here is not freed before this loop iteration ends, whoever joins or leaves meanwhile
+    const RoomMembers *members = room->members.load();
+    if (fanOutWanted(members->size())) {
+        // The other loops get to it later, so they need a reference of their own
+        std::shared_ptr<const RoomMembers> held;
+        {
+            RoomShard &shard = roomShardOf(room->name.data(), room->name.size());
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            held = room->members_held;
+        }
+        fanOut(held, message, kind, sender_sockfd);
+        return;
+    }
+    for (size_t i = 0; i < members->size(); i++) {
+        const RoomMember &member = (*members)[i];
+        if (member.sockfd != sender_sockfd) {
+            if (sendToSession(member.sockfd, member.generation, message, kind) < 0) {
+                std::cerr << "Failed to send message to client socket: " << member.sockfd << std::endl;
+            }
+        }
+    }
+}
+
+/*
+ * Function: joinRoom
+ * Purpose: This function adds a client to a room, creating the room if it is new, and tells the other members
+ * Parameters: The client, and the room name and its length
+*/
+static void joinRoom(ClientSession &session, const char *name, size_t length) {
+    if (session.user_id == NO_USER) {
+        sendToClient(session.sockfd, std::string("ERR 5\n"), REPLY_ERROR);
+        return;
+    }
+    std::string room_name(name, length);
+    Room *room = findRoom(session, name, length);
+    if (room == NULL) {
+        if (session.rooms.size() >= MAX_USER_ROOMS) {
+            sendToClient(session.sockfd, std::string("You are in too many rooms.\n"));
+            return;
+        }
+        {
+            RoomShard &shard = roomShardOf(name, length);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            std::unordered_map<std::string, Room *>::iterator it = shard.rooms.find(room_name);
+            if (it == shard.rooms.end()) {
+                room = new Room;
+                room->name = room_name;
+                historyInit(room->history, HISTORY_ROOM_BYTES, HISTORY_ROOM_MESSAGES);
+                room->members_held = std::make_shared<const RoomMembers>();
+                room->members.store(room->members_held.get());
+                shard.rooms.insert(std::make_pair(room_name, room));
+            }
+            else {
+                room = it->second;
+            }
+            std::shared_ptr<const RoomMembers> previous = room->members_held;
+            std::shared_ptr<RoomMembers> next = std::make_shared<RoomMembers>(*previous);
+            RoomMember member = {session.user_id, session.sockfd, session.generation};
+            next->push_back(member);
+            room->members_held = next;
+            room->members.store(next.get());
+            retireRoom(previous, NULL);
+        }
+        session.rooms.push_back(room);
+
+        const RosterName &user = rosterName(session.user_id);
+        broadcastRoom(room, std::make_shared<const std::string>(
+                std::string(user.text, user.len) + " joined #" + room_name + ".\n"), REPLY_PRESENCE, session.sockfd);
+    }
+    size_t count = room->members.load()->size();
+    sendToClient(session.sockfd, "Joined #" + room_name + " (" + std::to_string(count) + (count == 1 ? " member).\n" : " members).\n"));
+    if (history_replay > 0) {
+        SharedMessage replay = historyReplay(room->history, history_replay);
+        if (replay) {
+            sendToClient(session.sockfd, replay);
+        }
+    }
+}
+
+/*
+ * Function: partRoom
+ * Purpose: This function takes a client out of a room, and the room away once it is empty
+ * Parameters: The client, the room, and whether to tell the client and the other members
+*/
+static void partRoom(ClientSession &session, Room *room, bool announce) {
+    bool emptied;
+    {
+        RoomShard &shard = roomShardOf(room->name.data(), room->name.size());
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::shared_ptr<const RoomMembers> previous = room->members_held;
+        std::shared_ptr<RoomMembers> next = std::make_shared<RoomMembers>();
+        next->reserve(previous->size());
+        for (size_t i = 0; i < previous->size(); i++) {
+            if ((*previous)[i].id != session.user_id) {
+                next->push_back((*previous)[i]);
+            }
+        }
+        room->members_held = next;
+        room->members.store(next.get());
+        emptied = next->empty();
+        if (emptied) {
+            shard.rooms.erase(room->name);
+        }
+        retireRoom(previous, NULL);
+    }
+    session.rooms.erase(std::find(session.rooms.begin(), session.rooms.end(), room));
+
+    std::string room_name = room->name;
+    if (announce && !emptied) {
+        const RosterName &user = rosterName(session.user_id);
+        broadcastRoom(room, std::make_shared<const std::string>(
+                std::string(user.text, user.len) + " left #" + room_name + ".\n"), REPLY_PRESENCE, session.sockfd);
+    }
+    if (emptied) {
+        // Nobody is left to reach it, but a loop may still be reading it
+        retireRoom(room->members_held, room);
+    }
+    if (announce) {
+        sendToClient(session.sockfd, "Left #" + room_name + ".\n");
+    }
+}
+
+/*
+ * Function: moveRoomMember
+ * Purpose: To put a member of a room on another connection, for a session that was resumed. Nobody is told.
+ * Parameters: The room, the member's roster ID so far, and what it is now
+*/
+static void moveRoomMember(Room *room, uint32_t id, const RoomMember &moved) {
+    RoomShard &shard = roomShardOf(room->name.data(), room->name.size());
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    std::shared_ptr<const RoomMembers> previous = room->members_held;
+    std::shared_ptr<RoomMembers> next = std::make_shared<RoomMembers>(*previous);
+    for (size_t i = 0; i < next->size(); i++) {
+        if ((*next)[i].id == id) {
+            (*next)[i] = moved;
+        }
+    }
+    room->members_held = next;
+    room->members.store(next.get());
+    retireRoom(previous, NULL);
+}
+
+/*
+ * Function: roomCommand
+ * Purpose: This function checks the room name of JOIN or PART and carries the command out
+ * Parameters: The scanned command, and the socket descriptor
+*/
+static void roomCommand(const CommandScan &scan, int sockfd) {
+    switch (checkUsername(scan)) {
+        case USERNAME_EMPTY: {
+            std::string empty = std::string("Please enter a room name after '") + (scan.cmd == CMD_JOIN ? "JOIN" : "PART") + "'.\n";
+            sendToClient(sockfd, empty);
+            return;
+        }
+        // Room names follow the username rules
+        case USERNAME_TOO_LONG:
+            sendToClient(sockfd, std::string("ERR 1\n"), REPLY_ERROR);
+            return;
+        case USERNAME_HAS_SPACE:
+            sendToClient(sockfd, std::string("ERR 2\n"), REPLY_ERROR);
+            return;
+        case USERNAME_OK:
+            break;
+    }
+    ClientSession *session = sessionOf(sockfd);
+    if (session == NULL) {
+        return;
+    }
+    if (scan.cmd == CMD_JOIN) {
+        joinRoom(*session, scan.arg, scan.arg_len);
+        return;
+    }
+    Room *room = findRoom(*session, scan.arg, scan.arg_len);
+    if (room == NULL) {
+        sendToClient(sockfd, std::string("ERR 5\n"), REPLY_ERROR);
+        return;
+    }
+    partRoom(*session, room, true);
+}
+
+/*
+ * Function: sendRoomMessage
+ * Purpose: This function sends what a member says in a room to the room's other members
+ * Parameters: The room name and its length, the message and its length, the sender's socket descriptor, and
+ *             the sender's username
+*/
+static void sendRoomMessage(const char *name, size_t name_len, const char *message, size_t length,
+                            int sender_sockfd, const RosterName& sender_username) {
+    ClientSession *session = sessionOf(sender_sockfd);
+    Room *room = session == NULL ? NULL : findRoom(*session, name, name_len);
+    if (room == NULL) {
+        sendToClient(sender_sockfd, std::string("ERR 5\n"), REPLY_ERROR);
+        return;
+    }
+    // Formatted once, in a reused buffer, and shared by every member's queue
+    std::shared_ptr<std::string> buffer = takeBuffer(*current_reactor);
+    buffer->append(sender_username.text, sender_username.len).append(" (#").append(name, name_len).append("): ").append(message, length)
+           .append(1, '\n');
+    historyAppend(room->history, buffer->data(), buffer->size() - 1);
+    messageLog(MSGLOG_ROOM, name, name_len, buffer->data(), buffer->size() - 1);
+    broadcastRoom(room, buffer, REPLY_PUBLIC, sender_sockfd);
+}
+
+/*
+ * Function: historyCommand
+ * Purpose: This function replays the last messages of the public chat, or of one of the client's rooms, to the client
+ * Parameters: The request (the room is the first arg_space bytes of the argument, none for the public chat),
+ *             and the socket descriptor
+*/
+static void historyCommand(const Request &request, int sockfd) {
+    // Asking for no messages at all is as malformed as a count that is not a number
+    if (request.count <= 0) {
+        sendToClient(sockfd, std::string("ERR 4\n"), REPLY_ERROR);
+        return;
+    }
+    ClientSession *session = sessionOf(sockfd);
+    if (session == NULL || session->user_id == NO_USER) {
+        sendToClient(sockfd, std::string("ERR 5\n"), REPLY_ERROR);
+        return;
+    }
+    HistoryRing *ring = &public_history;
+    if (request.scan.arg_space > 0) {
+        Room *room = findRoom(*session, request.scan.arg, request.scan.arg_space);
+        if (room == NULL) {
+            sendToClient(sockfd, std::string("ERR 5\n"), REPLY_ERROR);
+            return;
+        }
+        ring = &room->history;
+    }
+    SharedMessage replay = historyReplay(*ring, request.count);
+    if (!replay) {
+        sendToClient(sockfd, std::string("No messages yet.\n"));
+        return;
+    }
+    sendToClient(sockfd, replay);
+}
+
+// What registerUser() found
+enum RegisterResult { REGISTER_OK, REGISTER_NAME_TAKEN, REGISTER_ADDR_TAKEN, REGISTER_FULL };
+
+/*
+ * Function: registerUser
+ * Purpose: To claim a username for a client. The checks and the claim happen with the shards of the name and
+ *          the address held, so two clients registering the same name at once cannot both get it. The client
+ *          gets its roster ID here.
+ * Parameters: The username, the client, and the client address
+*/
+static RegisterResult registerUser(const std::string& username, ClientSession &session, const std::string& client_ipaddress) {
+    uint32_t id = rosterReserve();
+    if (id == NO_USER) {
+        return REGISTER_FULL;
+    }
+    {
+        RegistryShard &shard = registry_shards[shardOf(username)];
+        RegistryShard &addr_shard = registry_shards[shardOf(client_ipaddress)];
+        ShardLock lock(shardOf(username), shardOf(client_ipaddress));
+        RegisterResult taken = REGISTER_OK;
+        bool reclaimed = false;
+        std::unordered_map<std::string, Registration>::iterator it = shard.by_name.find(username);
+        // With mailboxes on, a user who is not connected gets their name back from the address they had it on;
+        // it is already on record, so nothing is logged
+        if (offline_hold_ms > 0 && it != shard.by_name.end() && it->second.sockfd < 0 && it->second.addr == client_ipaddress) {
+            it->second.sockfd = session.sockfd;
+            it->second.away_until = 0;
+            reclaimed = true;
+        }
+        else if (offline_hold_ms > 0 && it == shard.by_name.end() && baseHasUser(username) && baseAddrOf(username) == client_ipaddress) {
+            Registration registration = {client_ipaddress, session.sockfd, 0};
+            shard.by_name.insert(std::make_pair(username, registration));
+            addr_shard.by_addr.insert(std::make_pair(client_ipaddress, username));
+            reclaimed = true;
+        }
+        else if (it != shard.by_name.end() || baseHasUser(username)) {
+            taken = REGISTER_NAME_TAKEN;
+        }
+        else if (addr_shard.by_addr.count(client_ipaddress) != 0 || baseHasAddr(client_ipaddress)) {
+            taken = REGISTER_ADDR_TAKEN;
+        }
+        if (taken != REGISTER_OK) {
+            rosterRelease(id);
+            return taken;
+        }
+        if (!reclaimed) {
+            Registration registration = {client_ipaddress, session.sockfd, 0};
+            shard.by_name.insert(std::make_pair(username, registration));
+            addr_shard.by_addr.insert(std::make_pair(client_ipaddress, username));
+            // Make it stay taken across restarts
+            registryAppend("+ " + username + " " + client_ipaddress + "\n");
+        }
+    }
+    session.user_id = id;
+    rosterJoin(id, session.sockfd, session.generation, username, session.presence_deltas);
+    return REGISTER_OK;
+}
+
+/*
+ * Function: forgetName
+ * Purpose: To take a username out of the registry for good, so someone else may have it
+ * Parameters: The username, and for a name held for a dropped client, when its hold runs out (0 otherwise);
+ *             a held name that was reclaimed, or dropped again since, is left alone
+*/
+static void forgetName(const std::string& username, uint64_t away_until) {
+    // Only its owner, or the sweeper once the hold runs out, removes a name, so its address stays put; the
+    // snapshot can still be replaced between looking and locking, in which case look again
+    RegistryShard &shard = registry_shards[shardOf(username)];
+    for ( ; ; ) {
+        std::string addr, base_addr;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            std::unordered_map<std::string, Registration>::const_iterator it = shard.by_name.find(username);
+            addr = it == shard.by_name.end() ? std::string() : it->second.addr;
+            base_addr = baseAddrOf(username);
+        }
+        ShardLock lock(shardOf(username), shardOf(addr), shardOf(base_addr));
+        if (baseAddrOf(username) != base_addr) {
+            continue;
+        }
+        if (away_until != 0) {
+            std::unordered_map<std::string, Registration>::const_iterator it = shard.by_name.find(username);
+            if (it == shard.by_name.end() || it->second.sockfd >= 0 || it->second.away_until != away_until) {
+                return;
+            }
+        }
+        if (forgetUser(username)) {
+            registryAppend("- " + username + "\n");
+        }
+        return;
+    }
+}
+
+/*
+ * Function: forgetResumeToken
+ * Purpose: To retire a session's resume token once the session ends
+ * Parameters: The client
+*/
+static void forgetResumeToken(ClientSession &session) {
+    if (session.resume_token.empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(resume_mutex);
+        std::unordered_map<std::string, std::pair<int, unsigned> >::iterator it = resume_tokens.find(session.resume_token);
+        if (it != resume_tokens.end() && it->second.first == session.sockfd && it->second.second == session.generation) {
+            resume_tokens.erase(it);
+        }
+    }
+    session.resume_token.clear();
+    std::string().swap(session.window);
+}
+
+/*
+ * Function: unregisterUser
+ * Purpose: To remove a client from every data structure that holds information about it. A client that
+ *          dropped can have its name held instead, with a mailbox for the private messages sent to it meanwhile.
+ * Parameters: The socket descriptor, its username (empty if it never registered), and whether to hold the name
+*/
+static void unregisterUser(int sockfd, const std::string& username, bool hold = false) {
+    // Only registered clients are on the roster
+    ClientSession *session = sessionOf(sockfd);
+    if (session == NULL || session->user_id == NO_USER) {
+        return;
+    }
+    forgetResumeToken(*session);
+    // Everyone in its rooms hears it left the chat, so the rooms are left quietly
+    while (!session->rooms.empty()) {
+        partRoom(*session, session->rooms.back(), false);
+    }
+    rosterLeave(session->user_id);
+    session->user_id = NO_USER;
+
+    if (!hold) {
+        forgetName(username, 0);
+        return;
+    }
+    uint64_t away_until = monotonicMs() + offline_hold_ms;
+    {
+        RegistryShard &shard = registry_shards[shardOf(username)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::unordered_map<std::string, Registration>::iterator it = shard.by_name.find(username);
+        if (it == shard.by_name.end()) {
+            return;
+        }
+        it->second.sockfd = -1;
+        it->second.away_until = away_until;
+    }
+    std::lock_guard<std::mutex> lock(offline_away_mutex);
+    offline_away.push_back(std::make_pair(away_until, username));
+}
+
+/*
+ * Function: offlineSweeper
+ * Purpose: To forget the names of dropped clients that did not come back in time, with their mailboxes.
+ *          Holds all last equally long, so they run out in the order they were taken.
+*/
+static void offlineSweeper() {
+    for ( ; ; ) {
+        sleep(1);
+        uint64_t now = monotonicMs();
+        for ( ; ; ) {
+            std::pair<uint64_t, std::string> away;
+            {
+                std::lock_guard<std::mutex> lock(offline_away_mutex);
+                if (offline_away.empty() || offline_away.front().first > now) {
+                    break;
+                }
+                away.first = offline_away.front().first;
+                away.second.swap(offline_away.front().second);
+                offline_away.pop_front();
+            }
+            forgetName(away.second, away.first);
+        }
+    }
+}
+
+/*
+ * Function: broadcastJoin
+ * Purpose: This function broadcasts to every other client that someone joined
+ * Parameters: The message being sent out, the same as a delta, and the socket descriptor of the client joining
+*/
+void broadcastJoin(const std::string& message, const std::string& delta, int sender_sockfd) {
+    SharedMessage shared = std::make_shared<const std::string>(message);
+    SharedMessage shared_delta = std::make_shared<const std::string>(delta);
+    uint32_t size = roster_size.load();
+    if (fanOutWanted(size)) {
+        fanOut(NULL, shared, REPLY_PRESENCE, sender_sockfd, shared_delta);
+        return;
+    }
+    for (uint32_t id = 0; id < size; id++) {
+        const RosterEntry &client = rosterEntry(id);
+        int sockfd = client.sockfd.load();
+        // If the client ID isn't the socket ID of the person joining, then send the message to that socket descriptor
+        if (sockfd >= 0 && sockfd != sender_sockfd) {
+            // Send the message, but if it fails, print out an error message
+            if (sendToSession(sockfd, client.generation, client.deltas ? shared_delta : shared, REPLY_PRESENCE) < 0) {
+                std::cerr << "Failed to send message to client socket: " << sockfd << std::endl;
+            }
+        }
+    }
+}
+
+/*
+ * Function: broadcastToAll
+ * Purpose: This function broadcasts to every client when a client leaves
+ * Parameters: The message being sent out, and the same as a delta
+*/
+void broadcastToAll(const std::string& message, const std::string& delta) {
+    SharedMessage shared = std::make_shared<const std::string>(message);
+    SharedMessage shared_delta = std::make_shared<const std::string>(delta);
+    uint32_t size = roster_size.load();
+    if (fanOutWanted(size)) {
+        fanOut(NULL, shared, REPLY_PRESENCE, -1, shared_delta);
+        return;
+    }
+    for (uint32_t id = 0; id < size; id++) {
+        const RosterEntry &client = rosterEntry(id);
+        int sockfd = client.sockfd.load();
+        if (sockfd >= 0 && sendToSession(sockfd, client.generation, client.deltas ? shared_delta : shared, REPLY_PRESENCE) < 0) {
+            std::cerr << "Failed to send message to client socket: " << sockfd << std::endl;
+        }
+    }
+}
+
+
+/*
+ * Function: broadcastMESG
+ * Purpose: This function broadcasts to every client what the sender says, and doesn't send to the sender
+ * Parameters: The message being sent out and its length, the sender's socket descriptor, and the sender's username
+*/
+void broadcastMESG(const char *message, size_t length, int sender_sockfd, const RosterName& sender_username) {
+    // Construct the message with the sender's username once, in a reused buffer; every recipient's queue shares it
+    std::shared_ptr<std::string> buffer = takeBuffer(*current_reactor);
+    buffer->append(sender_username.text, sender_username.len).append(" (Public): ").append(message, length).append(1, '\n');
+    SharedMessage full_message = buffer;
+    // History and the log keep the line without its newline
+    historyAppend(public_history, buffer->data(), buffer->size() - 1);
+    messageLog(MSGLOG_PUBLIC, NULL, 0, buffer->data(), buffer->size() - 1);
+
+    // No lock: a slot read here is not reused before this loop iteration ends, whoever joins or leaves meanwhile
+    uint32_t size = roster_size.load();
+    if (fanOutWanted(size)) {
+        fanOut(NULL, full_message, REPLY_PUBLIC, sender_sockfd);
+        return;
+    }
+
+    // Send the message to all clients except the sender
+    for (uint32_t id = 0; id < size; id++) {
+        const RosterEntry &client = rosterEntry(id);
+        int sockfd = client.sockfd.load();
+        if (sockfd >= 0 && sockfd != sender_sockfd) {
+            if (sendToSession(sockfd, client.generation, full_message, REPLY_PUBLIC) < 0) {
+                std::cerr << "Failed to send message to client socket: " << sockfd << std::endl;
+            }
+        }
+    }
+}
+
+/*
+ * Function: currentUserList
+ * Purpose: To get the user list as it stands, formatting it again only if someone joined or left since it was
+ *          last formatted. The version is read before the roster is, so a list that raced with a join or leave
+ *          is stamped too old and formatted again by the next caller rather than kept.
+ * Returns: The list, shared with every other caller until the roster changes
+*/
+static SharedMessage currentUserList() {
+    uint64_t version = roster_version.load();
+    std::lock_guard<std::mutex> lock(user_list_mutex);
+    if (user_list && user_list_version == version) {
+        user_list_shared++;
+        return user_list;
+    }
+
+    std::string names;
+    size_t user_count = 0;
+    uint32_t size = roster_size.load();
+    names.reserve(user_list ? user_list->size() + MAX_USERNAME + 1 : 64);
+    for (uint32_t id = 0; id < size; id++) {
+        if (rosterEntry(id).sockfd.load() >= 0) {
+            const RosterName &user = rosterName(id);
+            names.append(user.text, user.len);
+            names += '\n';
+            user_count++;
+        }
+    }
+    std::string header = std::to_string(user_count) + " Connected Users:\n";
+    std::shared_ptr<std::string> list = std::make_shared<std::string>();
+    list->reserve(header.size() + names.size());
+    *list += header;
+    *list += names;
+    user_list = list;
+    user_list_version = version;
+    user_list_builds++;
+    return user_list;
+}
+
+/*
+ * Function: sendUserList
+ * Purpose: This function sends the user list. Usually to a client joining/leaving
+ * Parameters: The socket descriptor of the person joining/leaving
+*/
+void sendUserList(int sockfd){
+    // Send the message to the client
+    ssize_t bytes_sent = sendToClient(sockfd, currentUserList());
+    if (bytes_sent < 0) {
+        std::cerr << "Failed to send ACK to client socket: " << sockfd << " Error: " << strerror(errno) << std::endl;
+    }
+}
+
+
+/*
+ * Function: sendUserPage
+ * Purpose: To send one page of the user list: "USERS <online> <n> <next>" and n names, one per line. The cursor
+ *          is a roster ID, so a page costs its own size however many users are online; next is where the
+ *          following page starts, or END. Users who join or leave while a client pages through may be missed
+ *          or listed twice, which is what the deltas it follows are for.
+ * Parameters: The socket descriptor, the roster ID to start at, and the most names to send
+*/
+static void sendUserPage(int sockfd, uint64_t cursor, size_t count) {
+    std::string names;
+    size_t listed = 0;
+    uint32_t size = roster_size.load();
+    uint64_t id = cursor;
+    for ( ; id < size && listed < count; id++) {
+        if (rosterEntry(id).sockfd.load() >= 0) {
+            const RosterName &user = rosterName(id);
+            names.append(user.text, user.len);
+            names += '\n';
+            listed++;
+        }
+    }
+    // Empty slots at the end would only make the next page come back empty
+    while (id < size && rosterEntry(id).sockfd.load() < 0) {
+        id++;
+    }
+    std::string page = "USERS " + std::to_string(roster_online.load()) + " " + std::to_string(listed) + " " +
+                       (id < size ? std::to_string(id) : std::string("END")) + "\n" + names;
+    sendToClient(sockfd, page);
+}
+
+/*
+ * Function: listCommand
+ * Purpose: This function handles LIST [cursor] [count], a page of the user list for a registered client
+ * Parameters: The request, and the socket descriptor
+*/
+static void listCommand(const Request &request, int sockfd) {
+    // A page of no names would hand back the cursor it was given, and a client paging to END would never get there
+    if (request.count <= 0) {
+        sendToClient(sockfd, std::string("ERR 4\n"), REPLY_ERROR);
+        return;
+    }
+    if (nameOf(sockfd).len == 0) {
+        sendToClient(sockfd, std::string("ERR 5\n"), REPLY_ERROR);
+        return;
+    }
+    sendUserPage(sockfd, request.has_position ? request.position : 0, request.count);
+}
+
+/*
+ * Function: deltasCommand
+ * Purpose: This function handles DELTAS, which a client sends before REG to get a page of the user list when it
+ *          registers instead of all of it, and joins and leaves as "+name" and "-name" after that
+ * Parameters: The request, and the socket descriptor
+*/
+static void deltasCommand(const Request &request, int sockfd) {
+    ClientSession *session = sessionOf(sockfd);
+    if (session == NULL) {
+        return;
+    }
+    if (request.scan.arg_len != 0 || session->user_id != NO_USER) {
+        sendToClient(sockfd, std::string("ERR 4\n"), REPLY_ERROR);
+        return;
+    }
+    session->presence_deltas = true;
+}
+
+/*
+ * Function: registration
+ * Purpose: This function registers the user and also checks the input for correct formatting
+ * Parameters: The scanned REG command, the socket descriptor, and the client address
+*/
+static void registration(const CommandScan &scan, int sockfd, const struct sockaddr_storage &cliaddr) {
+    // The scan that split the command already has everything needed to validate the username
+    switch (checkUsername(scan)) {
+        // Check if username is non-empty after the space
+        case USERNAME_EMPTY: {
+            std::string empty = "Please enter a valid username after 'REG'.\n";
+            sendToClient(sockfd, empty);
+            return;
+        }
+        // Username too long
+        case USERNAME_TOO_LONG: {
+            std::string lengthError = "ERR 1\n";
+            sendToClient(sockfd, lengthError, REPLY_ERROR);
+            return;
+        }
+        // Check for spaces in the username
+        case USERNAME_HAS_SPACE: {
+            std::string spaceError = "ERR 2\n";
+            sendToClient(sockfd, spaceError, REPLY_ERROR);
+            return;
+        }
+        case USERNAME_OK:
+            break;
+    }
+    std::string username_string(scan.arg, scan.arg_len);
+    std::string client_ipaddress = getClientAddrString(cliaddr);
+
+    ClientSession *session = sessionOf(sockfd);
+    if (session == NULL) {
+        return;
+    }
+
+    switch (registerUser(username_string, *session, client_ipaddress)) {
+        // Check if the username already exists
+        case REGISTER_NAME_TAKEN: {
+            std::string userExists = "ERR 3\n";
+            sendToClient(sockfd, userExists, REPLY_ERROR);
+            return;  // Exit if the username already exists
+        }
+        // If this address has a username already
+        case REGISTER_ADDR_TAKEN: {
+            std::string addrExists = "You already have a username.\n";
+            sendToClient(sockfd, addrExists);
+            return;
+        }
+        // No roster slot left
+        case REGISTER_FULL: {
+            std::string full = "The chat is full.\n";
+            sendToClient(sockfd, full);
+            return;
+        }
+        case REGISTER_OK:
+            break;
+    }
+
+    // Send ACK to the newly registered user with the list of connected users, or its first page for a
+    // client that follows the changes from here on
+    if (session->presence_deltas) {
+        sendUserPage(sockfd, 0, LIST_PAGE);
+    }
+    else {
+        sendUserList(sockfd);
+    }
+
+    // Hand over the private messages that came while they were away
+    if (offline_hold_ms > 0) {
+        deliverOffline(sockfd, username_string);
+    }
+
+    // Catch the new user up on the public chat, if the server is set to
+    if (history_replay > 0) {
+        SharedMessage replay = historyReplay(public_history, history_replay);
+        if (replay) {
+            sendToClient(sockfd, replay);
+        }
+    }
+
+    // Broadcast to other users that a new user has joined
+    std::string join_message = username_string + " has joined the chat.\n";
+    broadcastJoin(join_message, "+" + username_string + "\n", sockfd);
+}
+
+
+/*
+ * Function: sendPrivateMessage
+ * Purpose: This function lets one client send a private message to another client
+ * Parameters: The recipient's username and its length, the message being sent and its length, the file
+ *             descriptor of the sender, and the sender's username
+*/
+void sendPrivateMessage(const char *recipient, size_t recipient_len, const char *message, size_t length,
+                        int sender_sockfd, const RosterName& sender_username) {
+    // The lookup key is kept between calls, so setting it does not allocate once it has grown
+    static thread_local std::string recipient_username;
+    recipient_username.assign(recipient, recipient_len);
+
+    // Construct the message in a reused buffer
+    std::shared_ptr<std::string> buffer = takeBuffer(*current_reactor);
+    buffer->append("From ").append(sender_username.text, sender_username.len).append(" (private): ").append(message, length)
+           .append(1, '\n');
+    SharedMessage full_message = buffer;
+
+    {
+        // Only the recipient's shard is locked, and held while queueing so they cannot leave (and their socket
+        // be reused) in between
+        RegistryShard &shard = registry_shards[shardOf(recipient_username)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        // Find the socket descriptor of the recipient (users from an earlier run have none)
+        std::unordered_map<std::string, Registration>::const_iterator it = shard.by_name.find(recipient_username);
+        if (it != shard.by_name.end() && it->second.sockfd >= 0) {
+            messageLog(MSGLOG_PRIVATE, recipient, recipient_len, buffer->data(), buffer->size() - 1);
+            // Send the message to the recipient
+            if (sendToClient(it->second.sockfd, full_message, REPLY_PRIVATE) < 0) {
+                std::cerr << "Failed to send private message to client socket: " << it->second.sockfd << std::endl;
+            }
+            return;
+        }
+        // A user who is registered but not connected gets it when they are back
+        if (offline_hold_ms > 0 && (it != shard.by_name.end() || baseHasUser(recipient_username))) {
+            if (storeOffline(shard, recipient_username, full_message)) {
+                messageLog(MSGLOG_PRIVATE, recipient, recipient_len, buffer->data(), buffer->size() - 1);
+                return;
+            }
+            sendToClient(sender_sockfd, recipient_username + "'s mailbox is full.\n");
+            return;
+        }
+    }
+
+    // Recipient not found, send error to sender
+    std::string error_msg = "ERR 3\n";  // Error code for unknown user
+    sendToClient(sender_sockfd, error_msg, REPLY_ERROR);
+}
+
+/*
+ * Function: epollFinishClose
+ * Purpose: This function closes a departing client once the kernel is done with its zero-copy buffers.
+ *          A client that is cut off is reset instead, which throws its unsent data away, and its buffers
+ *          are kept for a grace period in case a driver is still sending from them.
+ * Parameters: The event loop, and the client
+*/
+static void epollFinishClose(Reactor &reactor, ClientSession &session) {
+    int sockfd = session.sockfd;
+    if (!session.zc_pins.empty()) {
+        if (!session.evicting) {
+            // The completions arrive on the error queue; sweepDraining gives up after the age limit
+            return;
+        }
+        struct linger reset = {1, 0};
+        setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &reset, sizeof reset);
+        for (size_t i = 0; i < session.zc_pins.size(); i++) {
+            reactor.zc_orphans.push_back(ZeroCopyPin());
+            reactor.zc_orphans.back().sent_ms = reactor.now_ms;
+            reactor.zc_orphans.back().bufs.swap(session.zc_pins[i].bufs);
+        }
+    }
+    reactor.sessions.erase(sockfd);
+    // Closing the descriptor also drops it from the epoll interest list
+    close(sockfd);
+}
+
+/*
+ * Function: epollReapZeroCopy
+ * Purpose: This function reads the zero-copy completions off a client's error queue and releases the
+ *          buffers of every send the kernel has finished with
+ * Parameters: The client
+*/
+static void epollReapZeroCopy(ClientSession &session) {
+    for ( ; ; ) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg(session.sockfd, &msg, MSG_ERRQUEUE) < 0) {
+            break;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cmsg), sizeof serr);
+            if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // The kernel copied the data after all (loopback does), so the notifications are pure overhead
+                session.zc_off = true;
+            }
+            // Sends [ee_info, ee_data] are complete; the counter wraps
+            for (size_t i = 0; i < session.zc_pins.size(); i++) {
+                if (session.zc_pins[i].id - serr.ee_info <= serr.ee_data - serr.ee_info) {
+                    session.zc_pins[i].done = true;
+                }
+            }
+        }
+    }
+    while (!session.zc_pins.empty() && session.zc_pins.front().done) {
+        session.zc_pins.pop_front();
+    }
+}
+
+/*
+ * Function: epollFlush
+ * Purpose: This function writes as much of a client's queue as the socket takes. Whatever is left waits
+ *          for the next EPOLLOUT, so a slow reader only ever holds up itself.
+ *          Large batches go out with MSG_ZEROCOPY, and their replies stay pinned until the kernel is done.
+ * Parameters: The event loop, and the client
+*/
+static void epollFlush(Reactor &reactor, ClientSession &session) {
+    struct iovec iov[FLUSH_IOVECS];
+
+    sealOutput(session);
+    // A dropped session waiting to be resumed, or one waiting to take over from another, keeps its replies
+    while (session.out_bytes > 0 && !session.evicting && !session.parked && !session.resuming) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        size_t replies;
+        msg.msg_iovlen = gatherOutput(session, iov, FLUSH_IOVECS, &replies);
+        // Like TCP_CORK: when the rest of the queue follows right after, don't push out a part-filled segment
+        int flags = MSG_NOSIGNAL | (replies < session.outq.size() ? MSG_MORE : 0);
+        // v2 frame headers live in the queue itself, which a zero-copy send may outlive
+        if (reactor.zerocopy && !session.zc_off && session.proto != PROTO_V2) {
+            size_t batch = 0;
+            for (size_t i = 0; i < msg.msg_iovlen; i++) {
+                batch += iov[i].iov_len;
+            }
+            if (batch >= zerocopy_min) {
+                flags |= MSG_ZEROCOPY;
+            }
+        }
+        ssize_t written = sendmsg(session.sockfd, &msg, flags);
+        if (written < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            // Out of socket option memory for notifications; copy this batch instead
+            flags &= ~MSG_ZEROCOPY;
+            written = sendmsg(session.sockfd, &msg, flags);
+        }
+        if (written >= 0) {
+            if (written > 0 && (flags & MSG_ZEROCOPY)) {
+                session.zc_pins.push_back(ZeroCopyPin());
+                session.zc_pins.back().id = session.zc_next_id++;
+                session.zc_pins.back().sent_ms = reactor.now_ms;
+                pinOutput(session, written, session.zc_pins.back().bufs);
+            }
+            consumeOutput(session, written);
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // The socket buffer is full; EPOLLOUT resumes here once the peer catches up
+            return;
+        }
+        if (!session.resume_token.empty()) {
+            // Kept for the client to resume; reading notices the connection is gone
+            return;
+        }
+        std::cerr << "Failed to send message to client socket: " << session.sockfd << std::endl;
+        discardOutput(session);
+    }
+
+    if (session.closing) {
+        epollFinishClose(reactor, session);
+    }
+}
+
+/*
+ * Function: epollFlushDirty
+ * Purpose: This function flushes every client that got replies during the current loop iteration
+ * Parameters: The event loop
+*/
+static void epollFlushDirty(Reactor &reactor) {
+    // Flushing can mark more clients dirty; they go on the other list, and both keep their storage
+    std::vector<int> &dirty = reactor.flushing;
+    dirty.swap(reactor.dirty);
+    for (size_t i = 0; i < dirty.size(); i++) {
+        std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(dirty[i]);
+        if (it != reactor.sessions.end()) {
+            it->second.queued = false;
+            epollFlush(reactor, it->second);
+        }
+    }
+    dirty.clear();
+}
+
+/*
+ * Function: closeClient
+ * Purpose: This function removes a departing client from the event loop. The socket is closed once the
+ *          replies queued for it (such as the final user list) have gone out and the kernel has released
+ *          any zero-copy buffers, or once they are older than the slow-consumer age limit.
+ * Parameters: The file descriptor of the client
+*/
+static void closeClient(int sockfd) {
+    Reactor &reactor = *current_reactor;
+    // Replies from other event loops are dropped from here on
+    fd_owners[sockfd].store(0, std::memory_order_release);
+    std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(sockfd);
+    if (it == reactor.sessions.end() || it->second.closing) {
+        return;
+    }
+    if ((it->second.out_bytes > 0 || !it->second.zc_pins.empty()) && !it->second.evicting) {
+        reactor.draining.push_back(sockfd);
+    }
+    if (reactor.backend == IO_URING) {
+        uringCloseClient(reactor, sockfd);
+        return;
+    }
+    it->second.closing = true;
+    markDirty(reactor, it->second);
+}
+
+/*
+ * Function: sweepDraining
+ * Purpose: This function gives up on closed clients that have not read their last replies within the age limit,
+ *          and frees the zero-copy buffers of reset clients once their grace period is over
+ * Parameters: The event loop
+*/
+static void sweepDraining(Reactor &reactor) {
+    size_t kept = 0;
+    for (size_t i = 0; i < reactor.zc_orphans.size(); i++) {
+        if (reactor.now_ms - reactor.zc_orphans[i].sent_ms < ZEROCOPY_GRACE_MS) {
+            reactor.zc_orphans[kept++].bufs.swap(reactor.zc_orphans[i].bufs);
+        }
+    }
+    reactor.zc_orphans.resize(kept);
+
+    std::vector<int> still_draining;
+    for (size_t i = 0; i < reactor.draining.size(); i++) {
+        int sockfd = reactor.draining[i];
+        std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(sockfd);
+        if (it == reactor.sessions.end() || !it->second.closing || it->second.evicting) {
+            continue;
+        }
+        ClientSession &session = it->second;
+        uint64_t oldest = reactor.now_ms;
+        if (session.out_bytes > 0) {
+            oldest = session.outq.front().queued_ms;
+        }
+        if (!session.zc_pins.empty()) {
+            oldest = std::min(oldest, session.zc_pins.front().sent_ms);
+        }
+        if ((session.out_bytes > 0 || !session.zc_pins.empty()) && reactor.now_ms - oldest <= out_max_age_ms) {
+            still_draining.push_back(sockfd);
+            continue;
+        }
+        slow_disconnected++;
+        session.evicting = true;
+        discardOutput(session);
+        if (reactor.backend == IO_URING) {
+            if (session.send_inflight) {
+                uringCancel(reactor, session, true);
+            }
+            else {
+                uringFinishClose(reactor, sockfd);
+            }
+        }
+        else {
+            epollFinishClose(reactor, session);
+        }
+    }
+    reactor.draining.swap(still_draining);
+}
+
+/*
+ * Function: parkClient
+ * Purpose: To keep a dropped session that has a resume token for its client to come back to. Its socket stays
+ *          open, unwatched, so the descriptor and everything that points at it (roster slot, rooms, registry)
+ *          stay its own, and replies keep queueing for it without being written. Nobody hears it left.
+ * Parameters: The event loop, and the client
+*/
+static void parkClient(Reactor &reactor, ClientSession &session) {
+    if (session.parked) {
+        return;
+    }
+    session.parked = true;
+    session.parked_until = reactor.now_ms + resume_hold_ms;
+    if (reactor.backend == IO_EPOLL) {
+        // A closed connection stays readable; io_uring's recv has already ended
+        epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, session.sockfd, NULL);
+    }
+    reactor.parked.push_back(std::make_pair(session.sockfd, session.generation));
+}
+
+/*
+ * Function: sendResume
+ * Purpose: To pass a session that is moving to the event loop that owns the connection it is going to or coming
+ *          from, like a reply. An old session that is gone already is answered for at once.
+ * Parameters: The socket descriptor and session generation, and the move
+*/
+static void sendResume(int sockfd, unsigned generation, const std::shared_ptr<ResumeState>& state) {
+    uint64_t owner = (sockfd >= 0 && (size_t)sockfd < fd_owners_size) ? fd_owners[sockfd].load(std::memory_order_acquire) : 0;
+    if (owner == 0 || (unsigned)owner != generation) {
+        if (!state->answered) {
+            state->answered = true;
+            sendResume(state->sockfd, state->generation, state);
+        }
+        else {
+            std::cerr << "Lost a resumed session for client socket: " << sockfd << std::endl;
+        }
+        return;
+    }
+    Reactor *reactor = reactors[(owner >> 32) - 1];
+    if (reactor == current_reactor) {
+        handleResume(*reactor, sockfd, generation, state);
+        return;
+    }
+    RemoteReply reply;
+    reply.sockfd = sockfd;
+    reply.generation = generation;
+    reply.kind = REPLY_DIRECT;
+    reply.resume = state;
+    mailboxPush(*reactor, reply);
+}
+
+/*
+ * Function: takeOverSession
+ * Purpose: To hand a session over to the connection its client resumed it on, on the session's own event loop.
+ *          The stream the client missed is cut from the window and the replies never written; then the roster
+ *          slot, the rooms and the registry are pointed at the new connection, and the old one is closed
+ *          without a word to anyone.
+ * Parameters: The old session (NULL if it is gone), and the move, which gets the answer
+*/
+static void takeOverSession(ClientSession *old, ResumeState &state) {
+    state.answered = true;
+    uint64_t end = old == NULL ? 0 : old->sent_seq + old->out_bytes;
+    if (old == NULL || old->user_id == NO_USER || old->resume_token != state.token || old->proto != state.proto ||
+        state.position < old->window_seq || state.position > end) {
+        return;
+    }
+    uint32_t id = rosterReserve();
+    if (id == NO_USER) {
+        return;
+    }
+
+    std::string &stream = state.retransmit;
+    if (state.position < old->sent_seq) {
+        stream.assign(old->window, state.position - old->window_seq, std::string::npos);
+    }
+    size_t skip = state.position > old->sent_seq ? state.position - old->sent_seq : 0;
+    size_t offset = old->out_offset;
+    for (OutQueue::const_iterator it = old->outq.begin(); it != old->outq.end(); ++it) {
+        size_t size = outSize(*it) - offset;
+        if (skip < size) {
+            copyOutput(*it, offset + skip, size - skip, stream);
+        }
+        skip -= std::min(skip, size);
+        offset = 0;
+    }
+
+    const RosterName &name = rosterName(old->user_id);
+    std::string username(name.text, name.len);
+    rosterJoin(id, state.sockfd, state.generation, username, old->presence_deltas);
+    RoomMember moved = {id, state.sockfd, state.generation};
+    for (size_t i = 0; i < old->rooms.size(); i++) {
+        moveRoomMember(old->rooms[i], old->user_id, moved);
+    }
+    {
+        RegistryShard &shard = registry_shards[shardOf(username)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::unordered_map<std::string, Registration>::iterator it = shard.by_name.find(username);
+        if (it != shard.by_name.end()) {
+            it->second.sockfd = state.sockfd;
+        }
+    }
+    rosterLeave(old->user_id);
+    {
+        std::lock_guard<std::mutex> lock(resume_mutex);
+        resume_tokens[state.token] = std::make_pair(state.sockfd, state.generation);
+    }
+    state.user_id = id;
+    state.rooms.swap(old->rooms);
+    state.presence_deltas = old->presence_deltas;
+    state.ok = true;
+
+    old->user_id = NO_USER;
+    old->resume_token.clear();
+    old->evicting = true;
+    discardOutput(*old);
+    closeClient(old->sockfd);
+}
+
+/*
+ * Function: finishResume
+ * Purpose: To give the connection that sent RESUME the session handed over to it, or tell it there is none.
+ *          The answer and the stream the client missed go in where RESUME was read: after what was queued for
+ *          the connection before it, ahead of what came for the session since. The stream is numbered on so
+ *          that the first byte after the answer is at the client's position.
+ * Parameters: The event loop, the new connection, and the move
+*/
+static void finishResume(Reactor &reactor, ClientSession &session, ResumeState &state) {
+    session.resuming = false;
+    std::string answer = state.ok ? "RESUMED " + std::to_string(state.position) + "\n" : "ERR 6\n";
+    std::shared_ptr<std::string> bytes = std::make_shared<std::string>();
+    if (session.proto == PROTO_V2) {
+        V2Header header;
+        header.length = answer.size();
+        header.opcode = state.ok ? V2_REPLY : V2_ERROR;
+        header.flags = V2_FLAG_REPLY;
+        header.seq = session.resume_reply_seq;
+        unsigned char raw[V2_HEADER_SIZE];
+        v2Encode(raw, header);
+        bytes->append((const char *)raw, V2_HEADER_SIZE);
+    }
+    bytes->append(answer);
+    size_t answer_len = bytes->size();
+    bytes->append(state.retransmit);
+
+    std::vector<OutMessage> later;
+    while (session.outq.size() > session.resume_mark) {
+        session.out_bytes -= outSize(session.outq.back());
+        later.push_back(std::move(session.outq.back()));
+        session.outq.pop_back();
+    }
+    if (session.outq.empty()) {
+        session.out_offset = 0;
+    }
+    if (state.ok) {
+        // resumeCommand() made sure the position is at least this large
+        session.sent_seq = state.position - answer_len - session.out_bytes;
+        session.window.clear();
+        session.window_seq = session.sent_seq;
+        session.user_id = state.user_id;
+        session.rooms.swap(state.rooms);
+        session.presence_deltas = state.presence_deltas;
+        session.resume_token = state.token;
+        resumes++;
+    }
+    else {
+        resume_failures++;
+    }
+    session.outq.push_back(OutMessage());
+    session.outq.back().data = bytes;
+    session.outq.back().kind = REPLY_DIRECT;
+    session.outq.back().queued_ms = reactor.now_ms;
+    session.out_bytes += bytes->size();
+    for (size_t i = later.size(); i-- > 0; ) {
+        session.out_bytes += outSize(later[i]);
+        session.outq.push_back(std::move(later[i]));
+    }
+    if (session.parked) {
+        // It dropped again while waiting; the hold starts over
+        session.parked_until = reactor.now_ms + resume_hold_ms;
+    }
+    else {
+        markDirty(reactor, session);
+    }
+}
+
+/*
+ * Function: handleResume
+ * Purpose: To take a session that is moving from its old connection, or give it to its new one
+ * Parameters: The event loop, the socket descriptor and session generation it was sent to, and the move
+*/
+static void handleResume(Reactor &reactor, int sockfd, unsigned generation, const std::shared_ptr<ResumeState>& state) {
+    std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(sockfd);
+    ClientSession *session = NULL;
+    if (it != reactor.sessions.end() && it->second.generation == generation && !it->second.closing) {
+        session = &it->second;
+    }
+    if (!state->answered) {
+        takeOverSession(session, *state);
+        sendResume(state->sockfd, state->generation, state);
+        return;
+    }
+    // A connection waiting for its answer is never closed, only parked
+    if (session == NULL) {
+        std::cerr << "Lost a resumed session for client socket: " << sockfd << std::endl;
+        return;
+    }
+    finishResume(reactor, *session, *state);
+}
+
+/*
+ * Function: resumeCommand
+ * Purpose: This function handles RESUME. Alone it gives a registered client a token for its session, and from
+ *          then on the session outlives a dropped connection for a while. With a token and the client's stream
+ *          position it moves that session onto this connection.
+ * Parameters: The request, and the socket descriptor
+*/
+static void resumeCommand(const Request &request, int sockfd) {
+    ClientSession *session = sessionOf(sockfd);
+    if (session == NULL) {
+        return;
+    }
+    if (resume_hold_ms == 0) {
+        sendToClient(sockfd, std::string("ERR 4\n"), REPLY_ERROR);
+        return;
+    }
+    if (request.scan.arg_len == 0) {
+        if (session->user_id == NO_USER) {
+            sendToClient(sockfd, std::string("ERR 5\n"), REPLY_ERROR);
+            return;
+        }
+        if (session->resume_token.empty()) {
+            unsigned char random[RESUME_TOKEN_LEN / 2];
+            if (syscall(SYS_getrandom, random, sizeof random, 0) != (long)sizeof random) {
+                std::cerr << "Failed to make a resume token: " << strerror(errno) << std::endl;
+                sendToClient(sockfd, std::string("ERR 6\n"), REPLY_ERROR);
+                return;
+            }
+            static const char hex[] = "0123456789abcdef";
+            std::string token;
+            for (size_t i = 0; i < sizeof random; i++) {
+                token += hex[random[i] >> 4];
+                token += hex[random[i] & 15];
+            }
+            {
+                std::lock_guard<std::mutex> lock(resume_mutex);
+                resume_tokens[token] = std::make_pair(sockfd, session->generation);
+            }
+            // Numbering starts at the connection's first byte; keeping a copy starts now
+            session->resume_token = token;
+            session->window_seq = session->sent_seq;
+        }
+        sendToClient(sockfd, "TOKEN " + session->resume_token + "\n");
+        return;
+    }
+    if (session->user_id != NO_USER || !request.has_position || request.scan.arg_space != RESUME_TOKEN_LEN) {
+        sendToClient(sockfd, std::string("ERR 4\n"), REPLY_ERROR);
+        return;
+    }
+    std::string token(request.scan.arg, RESUME_TOKEN_LEN);
+    std::pair<int, unsigned> target(-1, 0);
+    {
+        std::lock_guard<std::mutex> lock(resume_mutex);
+        std::unordered_map<std::string, std::pair<int, unsigned> >::iterator it = resume_tokens.find(token);
+        if (it != resume_tokens.end()) {
+            target = it->second;
+        }
+    }
+    // The answer and what is queued ahead of it are numbered just below the client's position, so a position
+    // smaller than those cannot be right. Nothing is written while resuming, so the queue only gets shorter.
+    size_t answer_len = (session->proto == PROTO_V2 ? V2_HEADER_SIZE : 0) +
+                        ("RESUMED " + std::to_string(request.position) + "\n").size();
+    if (target.first < 0 || request.position < answer_len + session->out_bytes) {
+        resume_failures++;
+        sendToClient(sockfd, std::string("ERR 6\n"), REPLY_ERROR);
+        return;
+    }
+    // Nothing more goes out on this connection until the answer, which goes in after what is queued now
+    session->resuming = true;
+    sealOutput(*session);
+    session->resume_mark = session->outq.size();
+    session->resume_reply_seq = session->reply_seq;
+    std::shared_ptr<ResumeState> state = std::make_shared<ResumeState>();
+    state->sockfd = sockfd;
+    state->generation = session->generation;
+    state->proto = session->proto;
+    state->reply_seq = session->reply_seq;
+    state->position = request.position;
+    state->token = token;
+    sendResume(target.first, target.second, state);
+}
+
+/*
+ * Function: ackCommand
+ * Purpose: This function handles ACK: the client has the stream up to the given position, so the window need
+ *          not keep it. Acks of a session without a token, or of bytes not written yet, change nothing.
+ * Parameters: The request, and the socket descriptor
+*/
+static void ackCommand(const Request &request, int sockfd) {
+    ClientSession *session = sessionOf(sockfd);
+    if (session == NULL) {
+        return;
+    }
+    if (!request.has_position) {
+        sendToClient(sockfd, std::string("ERR 4\n"), REPLY_ERROR);
+        return;
+    }
+    if (session->resume_token.empty() || request.position <= session->window_seq || request.position > session->sent_seq) {
+        return;
+    }
+    session->window.erase(0, request.position - session->window_seq);
+    session->window_seq = request.position;
+}
+
+/*
+ * Function: handleDisconnect
+ * Purpose: This function cleans up after a client that dropped without sending EXIT
+ * Parameters: The file descriptor of the client
+*/
+static void handleDisconnect(int newsockfd) {
+    // A session with a resume token waits for its client, and so does one waiting to take another over
+    ClientSession *session = sessionOf(newsockfd);
+    if (session != NULL && (session->resuming || (!session->resume_token.empty() && !session->parked && !session->evicting))) {
+        parkClient(*current_reactor, *session);
+        return;
+    }
+    if (session != NULL && session->parked) {
+        // The connection is long gone, so nothing queued can go out
+        session->evicting = true;
+        discardOutput(*session);
+    }
+    std::string disconnected_username = usernameOf(newsockfd);
+
+    // Notify other users that the user has left, if it ever registered
+    if (session != NULL && session->user_id != NO_USER) {
+        std::string leave_message = disconnected_username + " has left the chat.\n";
+        broadcastToAll(leave_message, "-" + disconnected_username + "\n");
+    }
+
+    // Clean up the client's data from the server, holding its name for a while if mailboxes are on
+    unregisterUser(newsockfd, disconnected_username, offline_hold_ms > 0);
+
+    // Close the socket for the disconnected client
+    closeClient(newsockfd);
+}
+
+/*
+ * Function: sweepParked
+ * Purpose: This function lets go of the dropped sessions whose client did not resume them in time; they leave
+ *          the chat as if they had just dropped
+ * Parameters: The event loop
+*/
+static void sweepParked(Reactor &reactor) {
+    size_t kept = 0;
+    for (size_t i = 0; i < reactor.parked.size(); i++) {
+        std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(reactor.parked[i].first);
+        if (it == reactor.sessions.end() || it->second.generation != reactor.parked[i].second ||
+            !it->second.parked || it->second.closing) {
+            // Resumed on another connection, or gone
+            continue;
+        }
+        if (it->second.resuming || reactor.now_ms < it->second.parked_until) {
+            reactor.parked[kept++] = reactor.parked[i];
+            continue;
+        }
+        resume_expired++;
+        handleDisconnect(reactor.parked[i].first);
+    }
+    reactor.parked.resize(kept);
+}
+
+/*
+ * Function: evictSlowClients
+ * Purpose: This function disconnects the clients the slow-consumer policy gave up on during this loop iteration.
+ *          It runs between iterations, when no handler is holding the registry lock.
+ * Parameters: The event loop
+*/
+static void evictSlowClients(Reactor &reactor) {
+    // handleDisconnect() queues leave messages, which may add (and evict) more clients while we walk the list
+    for (size_t i = 0; i < reactor.dirty.size(); i++) {
+        int sockfd = reactor.dirty[i];
+        std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(sockfd);
+        if (it != reactor.sessions.end() && it->second.evicting && !it->second.closing) {
+            std::cerr << "Disconnecting slow client socket: " << sockfd << std::endl;
+            slow_disconnected++;
+            handleDisconnect(sockfd);
+        }
+    }
+}
+
+/*
+ * Function: handleRequest
+ * Purpose: This function is the control center for the server. This will direct every command to the function that handles it
+ * Parameters: The file descriptor, the command whichever protocol it came in, and the Address of the client.
+ * Returns: false once the client has exited and its socket is closed
+*/
+static bool handleRequest(int newsockfd, const Request &request, const struct sockaddr_storage &cliaddr) {
+    const CommandScan &scan = request.scan;
+
+    if (scan.cmd == CMD_NONE) {
+        return true; // Ignore empty or whitespace-only messages
+    }
+
+    // If the command is REG, perform registration
+    if (scan.cmd == CMD_REG) {
+        registration(scan, newsockfd, cliaddr);
+    }
+        // If the command is MESG, get the username, content, and broadcast it
+    else if (scan.cmd == CMD_MESG) {
+        // The name and the text are read where they are, not copied
+        broadcastMESG(scan.arg, scan.arg_len, newsockfd, nameOf(newsockfd));
+    }
+        // If the command is PMSG, handle private messaging
+    else if (scan.cmd == CMD_PMSG) {
+        if (!request.has_text) {
+            std::string UnknownError = "ERR 4\n";
+            sendToClient(newsockfd, UnknownError, REPLY_ERROR);
+            return true;
+        }
+
+        sendPrivateMessage(scan.arg, scan.arg_space, request.text, request.text_len, newsockfd, nameOf(newsockfd));
+    }
+        // JOIN and PART a room
+    else if (scan.cmd == CMD_JOIN || scan.cmd == CMD_PART) {
+        roomCommand(scan, newsockfd);
+    }
+        // If the command is RMSG, send to one of the sender's rooms
+    else if (scan.cmd == CMD_RMSG) {
+        if (!request.has_text) {
+            std::string UnknownError = "ERR 4\n";
+            sendToClient(newsockfd, UnknownError, REPLY_ERROR);
+            return true;
+        }
+
+        sendRoomMessage(scan.arg, scan.arg_space, request.text, request.text_len, newsockfd, nameOf(newsockfd));
+    }
+        // HIST replays recent messages
+    else if (scan.cmd == CMD_HIST) {
+        historyCommand(request, newsockfd);
+    }
+        // RESUME and ACK keep a session across reconnects
+    else if (scan.cmd == CMD_RESUME) {
+        resumeCommand(request, newsockfd);
+    }
+    else if (scan.cmd == CMD_ACK) {
+        ackCommand(request, newsockfd);
+    }
+        // LIST pages through the users, DELTAS follows them as they come and go
+    else if (scan.cmd == CMD_LIST) {
+        listCommand(request, newsockfd);
+    }
+    else if (scan.cmd == CMD_DELTAS) {
+        deltasCommand(request, newsockfd);
+    }
+        // If the message is EXIT, handle the user exit
+    else if (scan.cmd == CMD_EXIT) {
+        std::string username = usernameOf(newsockfd);
+        ClientSession *session = sessionOf(newsockfd);
+
+        // Notify other users that the user has left, if it ever registered
+        if (session != NULL && session->user_id != NO_USER) {
+            std::string leave_message = username + " has left the chat.\n";
+            broadcastToAll(leave_message, "-" + username + "\n");
+        }
+
+        // Remove the user from the server's data structures
+        bool deltas = session != NULL && session->presence_deltas;
+        unregisterUser(newsockfd, username);
+        //Send the user list after the client credentials have been removed (a client following deltas has it)
+        if (!deltas) {
+            sendUserList(newsockfd);
+        }
+        // Close the socket and stop reading from it
+        closeClient(newsockfd);
+        return false;
+    }
+        // Unknown command handling
+    else {
+        std::string UnknownError = "ERR 4\n";
+        sendToClient(newsockfd, UnknownError, REPLY_ERROR);
+    }
+    return true;
+}
+
+/*
+ * Function: historyCount
+ * Purpose: To read the number of messages HIST asks for; more than any history keeps counts as all of it
+ * Parameters: The digits and how many there are
+ * Returns: The number, or -1 if it is not one
+*/
+static long historyCount(const char *digits, size_t length) {
+    long count = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (digits[i] < '0' || digits[i] > '9') {
+            return -1;
+        }
+        count = std::min<long>(count * 10 + (digits[i] - '0'), HISTORY_MESSAGES);
+    }
+    return count;
+}
+
+/*
+ * Function: parsePosition
+ * Purpose: To read a stream position given to RESUME or ACK
+ * Parameters: The digits and how many there are, and where to put the number
+ * Returns: false if it is not a number
+*/
+static bool parsePosition(const char *digits, size_t length, uint64_t &position) {
+    if (length == 0 || length > 19) {
+        return false;
+    }
+    position = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (digits[i] < '0' || digits[i] > '9') {
+            return false;
+        }
+        position = position * 10 + (digits[i] - '0');
+    }
+    return true;
+}
+
+/*
+ * Function: handleMessage
+ * Purpose: This function takes apart one line of the text protocol and runs it
+ * Parameters: The file descriptor, the line (without its newline) and its length, and the Address of the client.
+ * Returns: false once the client has exited and its socket is closed
+*/
+static bool handleMessage(int newsockfd, const char *mesg, size_t length, const struct sockaddr_storage &cliaddr) {
+    Request request;
+    // One pass finds the command and its argument with the spaces around it trimmed
+    request.scan = scanCommand(mesg, length);
+    request.has_text = (request.scan.cmd == CMD_PMSG || request.scan.cmd == CMD_RMSG || request.scan.cmd == CMD_HIST ||
+                        request.scan.cmd == CMD_RESUME || request.scan.cmd == CMD_LIST) &&
+                       splitPrivate(request.scan, request.text, request.text_len);
+    request.count = HISTORY_DEFAULT;
+    request.has_position = false;
+    if (request.scan.cmd == CMD_RESUME && request.has_text) {
+        // RESUME token position
+        request.has_position = parsePosition(request.text, request.text_len, request.position);
+    }
+    else if (request.scan.cmd == CMD_ACK) {
+        request.has_position = parsePosition(request.scan.arg, request.scan.arg_len, request.position);
+    }
+    else if (request.scan.cmd == CMD_LIST) {
+        // LIST [cursor] [count]
+        const CommandScan &scan = request.scan;
+        uint64_t count = LIST_PAGE;
+        request.has_position = scan.arg_len > 0;
+        if ((request.has_position && !parsePosition(scan.arg, scan.arg_space, request.position)) ||
+            (request.has_text && !parsePosition(request.text, request.text_len, count)) ||
+            (scan.arg_space < scan.arg_len && !request.has_text)) {
+            request.count = -1;
+        }
+        else {
+            request.count = std::min<uint64_t>(count, LIST_PAGE_MAX);
+        }
+    }
+    if (request.scan.cmd == CMD_HIST) {
+        // HIST [room] [n]: a lone number is a count for the public chat
+        CommandScan &scan = request.scan;
+        if (request.has_text) {
+            request.count = historyCount(request.text, request.text_len);
+        }
+        else if (scan.arg_len > 0 && historyCount(scan.arg, scan.arg_len) >= 0) {
+            request.count = historyCount(scan.arg, scan.arg_len);
+            scan.arg_space = 0;
+        }
+    }
+    return handleRequest(newsockfd, request, cliaddr);
+}
+
+/*
+ * Function: handleFrame
+ * Purpose: This function decodes one v2 frame and runs it. Payloads are taken as they are: no trimming,
+ *          and a message may hold any bytes, newlines included.
+ * Parameters: The file descriptor, the frame header and payload, and the Address of the client.
+ * Returns: false once the client has exited and its socket is closed
+*/
+static bool handleFrame(int newsockfd, const V2Header &header, const char *payload, const struct sockaddr_storage &cliaddr) {
+    Request request;
+    CommandScan &scan = request.scan;
+    scan.cmd = CMD_UNKNOWN;
+    scan.arg = payload;
+    scan.arg_len = header.length;
+    scan.arg_space = header.length;
+    request.has_text = false;
+    request.count = HISTORY_DEFAULT;
+    request.has_position = false;
+
+    switch (header.opcode) {
+        case V2_HELLO:
+            scan.cmd = CMD_NONE;
+            break;
+        case V2_REG:
+        case V2_JOIN:
+        case V2_PART:
+            scan.cmd = header.opcode == V2_REG ? CMD_REG : (header.opcode == V2_JOIN ? CMD_JOIN : CMD_PART);
+            // A username (or room name) may not hold spaces, and a binary one may not hold line breaks or other control bytes either
+            for (size_t i = 0; i < header.length; i++) {
+                if ((unsigned char)payload[i] <= ' ') {
+                    scan.arg_space = i;
+                    break;
+                }
+            }
+            break;
+        case V2_MESG:
+            scan.cmd = CMD_MESG;
+            break;
+        case V2_PMSG:
+        case V2_RMSG: {
+            scan.cmd = header.opcode == V2_PMSG ? CMD_PMSG : CMD_RMSG;
+            size_t name_len = header.length > 0 ? (unsigned char)payload[0] : 0;
+            if (name_len > 0 && 1 + name_len <= header.length) {
+                scan.arg = payload + 1;
+                scan.arg_len = header.length - 1;
+                scan.arg_space = name_len;
+                request.text = payload + 1 + name_len;
+                request.text_len = header.length - 1 - name_len;
+                request.has_text = true;
+            }
+            break;
+        }
+        case V2_EXIT:
+            scan.cmd = CMD_EXIT;
+            break;
+        case V2_HIST: {
+            scan.cmd = CMD_HIST;
+            size_t name_len = header.length > 0 ? (unsigned char)payload[0] : 0;
+            size_t rest = header.length - std::min<size_t>(header.length, 1 + name_len);
+            if (header.length > 0 && (1 + name_len > header.length || (rest != 0 && rest != 2))) {
+                request.count = -1;
+            }
+            else if (header.length > 0) {
+                scan.arg = payload + 1;
+                scan.arg_len = name_len;
+                scan.arg_space = name_len;
+                if (rest == 2) {
+                    const unsigned char *count = (const unsigned char *)payload + 1 + name_len;
+                    request.count = std::min<long>(count[0] << 8 | count[1], HISTORY_MESSAGES);
+                }
+            }
+            break;
+        }
+        case V2_RESUME:
+            scan.cmd = CMD_RESUME;
+            if (header.length == RESUME_TOKEN_LEN + 8) {
+                scan.arg_len = scan.arg_space = RESUME_TOKEN_LEN;
+                request.position = v2Get64((const unsigned char *)payload + RESUME_TOKEN_LEN);
+                request.has_position = true;
+            }
+            break;
+        case V2_ACK:
+            scan.cmd = CMD_ACK;
+            if (header.length == 8) {
+                request.position = v2Get64((const unsigned char *)payload);
+                request.has_position = true;
+            }
+            break;
+        case V2_LIST: {
+            const unsigned char *bytes = (const unsigned char *)payload;
+            scan.cmd = CMD_LIST;
+            request.count = LIST_PAGE;
+            if (header.length == 4 || header.length == 6) {
+                request.position = (uint64_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+                request.has_position = true;
+                if (header.length == 6) {
+                    request.count = std::min(bytes[4] << 8 | bytes[5], LIST_PAGE_MAX);
+                }
+            }
+            else if (header.length != 0) {
+                request.count = -1;
+            }
+            break;
+        }
+        case V2_DELTAS:
+            scan.cmd = CMD_DELTAS;
+            break;
+    }
+    return handleRequest(newsockfd, request, cliaddr);
+}
+
+/*
+ * Function: handleInput
+ * Purpose: This function runs every complete command waiting in a client's receive ring, as text lines or
+ *          v2 frames depending on how the client opened the connection. A client may send any number of
+ *          commands in one write, and a command may arrive split over several reads.
+ * Parameters: The event loop, and the file descriptor of the client
+ * Returns: false once the client has exited and its socket is closed
+*/
+static bool handleInput(Reactor &reactor, int newsockfd) {
+    char line[MAX_LINE];
+    size_t length;
+
+    for ( ; ; ) {
+        // Look the session up again every time, a command may close it
+        std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(newsockfd);
+        if (it == reactor.sessions.end() || it->second.closing) {
+            return false;
+        }
+        ClientSession &session = it->second;
+
+        if (session.proto == PROTO_UNKNOWN) {
+            if (!negotiateProtocol(session)) {
+                return true;
+            }
+            if (session.proto == PROTO_V2) {
+                std::string hello;
+                sendToClient(newsockfd, hello, REPLY_HELLO);
+            }
+            continue;
+        }
+
+        if (session.proto == PROTO_V2) {
+            V2Header header;
+            int framed = ringNextFrame(session.in, header, line);
+            if (framed == 0) {
+                return true;
+            }
+            if (framed < 0) {
+                // There is no finding the next frame after a bad length, so the client has to go
+                std::string UnknownError = "ERR 4\n";
+                sendToClient(newsockfd, UnknownError, REPLY_ERROR);
+                handleDisconnect(newsockfd);
+                return false;
+            }
+            struct sockaddr_storage cliaddr = session.cliaddr;
+            session.replying = true;
+            session.reply_seq = header.seq;
+            if (session.resuming) {
+                // Nothing runs until the session this connection resumes has been handed over
+                sendToClient(newsockfd, std::string("ERR 6\n"), REPLY_ERROR);
+                session.replying = false;
+                continue;
+            }
+            bool open = handleFrame(newsockfd, header, line, cliaddr);
+            it = reactor.sessions.find(newsockfd);
+            if (it != reactor.sessions.end()) {
+                it->second.replying = false;
+            }
+            if (!open) {
+                return false;
+            }
+            continue;
+        }
+
+        bool overflow;
+        if (!ringNextLine(it->second.in, line, length, overflow)) {
+            return true;
+        }
+        if (overflow) {
+            std::string UnknownError = "ERR 4\n";
+            sendToClient(newsockfd, UnknownError, REPLY_ERROR);
+            continue;
+        }
+        if (it->second.resuming) {
+            // Nothing runs until the session this connection resumes has been handed over
+            sendToClient(newsockfd, std::string("ERR 6\n"), REPLY_ERROR);
+            continue;
+        }
+        // Copy the address, the session entry goes away if the client exits
+        struct sockaddr_storage cliaddr = it->second.cliaddr;
+        if (!handleMessage(newsockfd, line, length, cliaddr)) {
+            return false;
+        }
     }
+}
 
-    freeaddrinfo(servinfo); // Done with this structure
+/*
+ * Function: handleClient
+ * Purpose: This function drains a readable client socket into its receive ring. Because the socket is
+ *          edge-triggered, it reads until the kernel has nothing left and runs every command it completes.
+ * Parameters: The event loop, and the file descriptor of the client
+*/
+static void handleClient(Reactor &reactor, int newsockfd) {
+    for ( ; ; ) {
+        std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(newsockfd);
+        if (it == reactor.sessions.end() || it->second.closing) {
+            return;
+        }
+
+        struct iovec iov[2];
+        int count = ringSpace(it->second.in, iov);
+        ssize_t datalen = readv(newsockfd, iov, count);
+        if (datalen > 0) {
+            it->second.in.tail += datalen;
+            if (!handleInput(reactor, newsockfd)) {
+                return;
+            }
+        }
+        else if (datalen == 0) {
+            // The client disconnected without sending EXIT
+            handleDisconnect(newsockfd);
+            return;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // Everything the client sent has been handled; wait for the next readiness event
+            return;
+        }
+        else if (errno != EINTR) {
+            std::cerr << "Error receiving from client" << std::endl;
+            handleDisconnect(newsockfd);
+            return;
+        }
+    }
+}
+
+/*
+ * Function: acceptClients
+ * Purpose: This function accepts every pending connection on the loop's listening socket and registers it with epoll
+ * Parameters: The event loop
+*/
+static void acceptClients(Reactor &reactor) {
+    for ( ; ; ) {
+        struct sockaddr_storage cliaddr;
+        socklen_t addrlen = sizeof cliaddr;
+        int newsockfd = accept(reactor.listen_fd, (struct sockaddr *)&cliaddr, &addrlen);
+        if (newsockfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                cerr << "server: can't accept connection" << endl;
+            }
+            return;
+        }
+
+        if (!setNonBlocking(newsockfd)) {
+            cerr << "server: can't make client socket non-blocking" << endl;
+            close(newsockfd);
+            continue;
+        }
+
+        struct epoll_event ev = {};
+        // EPOLLOUT is edge-triggered too, so it only fires when a full socket drains again
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = newsockfd;
+        if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0) {
+            cerr << "server: can't watch client socket" << endl;
+            close(newsockfd);
+            continue;
+        }
+
+        ClientSession session;
+        session.sockfd = newsockfd;
+        session.cliaddr = cliaddr;
+        if (reactor.zerocopy) {
+            int one = 1;
+            session.zc_off = setsockopt(newsockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) < 0;
+        }
+        if (adoptClient(reactor, session) == NULL) {
+            cerr << "server: too many open descriptors" << endl;
+            close(newsockfd);
+        }
+    }
+}
+
+/*
+ * Function: raiseFileLimit
+ * Purpose: Every idle session holds a descriptor, so lift the soft descriptor limit as high as we are allowed,
+ *          but no higher than the owner table covers
+*/
+static void raiseFileLimit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max && rl.rlim_cur < FD_OWNERS_MAX) {
+        rl.rlim_cur = std::min<rlim_t>(rl.rlim_max, FD_OWNERS_MAX);
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * Function: uringAcceptClient
+ * Purpose: This function sets up a client accepted by the multishot accept and starts receiving from it
+ * Parameters: The event loop, and the new socket descriptor
+*/
+static void uringAcceptClient(Reactor &reactor, int newsockfd) {
+    ClientSession session;
+    session.sockfd = newsockfd;
+    socklen_t addrlen = sizeof session.cliaddr;
+    if (getpeername(newsockfd, (struct sockaddr *)&session.cliaddr, &addrlen) < 0) {
+        close(newsockfd);
+        return;
+    }
+    ClientSession *stored = adoptClient(reactor, session);
+    if (stored == NULL) {
+        cerr << "server: too many open descriptors" << endl;
+        close(newsockfd);
+        return;
+    }
+    uringArmRecv(reactor, *stored);
+}
+
+/*
+ * Function: uringHandleCompletion
+ * Purpose: This function dispatches one io_uring completion to the accept, receive, or send handling
+ * Parameters: The event loop, and the completion
+*/
+static void uringHandleCompletion(Reactor &reactor, const struct io_uring_cqe &cqe) {
+    UringOp op = (UringOp)(cqe.user_data >> 56);
+    unsigned generation = (cqe.user_data >> 32) & 0xffffff;
+    int fd = (int)(uint32_t)cqe.user_data;
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    if (op == URING_ACCEPT) {
+        if (cqe.res >= 0) {
+            uringAcceptClient(reactor, cqe.res);
+        }
+        else {
+            cerr << "server: can't accept connection" << endl;
+        }
+        if (!more) {
+            uringArmAccept(reactor);
+        }
+        return;
+    }
+    if (op == URING_WAKE) {
+        // Another event loop left replies for our clients
+        drainMailbox(reactor);
+        uringArmWake(reactor);
+        return;
+    }
+    if (op == URING_TICK) {
+        reactor.tick_armed = false;
+        sweepDraining(reactor);
+        sweepParked(reactor);
+        return;
+    }
+    if (op == URING_CANCEL) {
+        return;
+    }
+    if (op == URING_SEND_ZC) {
+        // The result comes first; with IORING_CQE_F_MORE set a notification follows once the buffers are free
+        ZeroCopyPin *pin = (ZeroCopyPin *)(uintptr_t)(cqe.user_data & ((1ULL << 56) - 1));
+        if (cqe.flags & IORING_CQE_F_NOTIF) {
+            delete pin;
+            return;
+        }
+        std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(pin->sockfd);
+        if (it != reactor.sessions.end() && it->second.generation == pin->generation) {
+            if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+                // No zero-copy sends on this kernel or socket; send the same replies again the usual way
+                cerr << "server: zero-copy sends are not supported, sending normally" << endl;
+                reactor.zerocopy = false;
+                it->second.send_inflight = false;
+                markDirty(reactor, it->second);
+            }
+            else {
+                uringSendDone(reactor, it->second, cqe.res);
+            }
+        }
+        if (!more) {
+            delete pin;
+        }
+        return;
+    }
+
+    std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(fd);
+    bool current = it != reactor.sessions.end() && it->second.generation == generation;
+
+    if (op == URING_SEND) {
+        if (current) {
+            uringSendDone(reactor, it->second, cqe.res);
+        }
+        return;
+    }
+
+    // URING_RECV: move the data into the client's ring and recycle the buffer before any handler runs
+    bool have_data = false;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (current && !it->second.closing && cqe.res > 0) {
+            ringWrite(it->second.in, reactor.uring.bufs + (size_t)bid * BUF_SIZE, cqe.res);
+            have_data = true;
+        }
+        uringProvideBuffer(reactor, bid);
+    }
+    if (!current || it->second.closing) {
+        return;
+    }
+
+    if (have_data) {
+        if (!handleInput(reactor, fd)) {
+            return;
+        }
+    }
+    else if (cqe.res == 0) {
+        // The client disconnected without sending EXIT
+        handleDisconnect(fd);
+        return;
+    }
+    else if (cqe.res != -ENOBUFS) {
+        std::cerr << "Error receiving from client" << std::endl;
+        handleDisconnect(fd);
+        return;
+    }
+
+    // The multishot recv stops when the buffer ring runs dry; buffers are back, so start it again
+    if (!more) {
+        it = reactor.sessions.find(fd);
+        if (it != reactor.sessions.end() && !it->second.closing) {
+            uringArmRecv(reactor, it->second);
+        }
+    }
+}
+
+/*
+ * Function: runUringLoop
+ * Purpose: This function runs an event loop on io_uring. Every iteration submits all queued work with one
+ *          io_uring_enter(), waits for at least one completion, and handles every completion that is ready.
+ * Parameters: The event loop
+*/
+static void runUringLoop(Reactor &reactor) {
+    // Relative one-second timeout that wakes the loop while closed clients are still draining
+    struct __kernel_timespec tick = {1, 0};
+
+    uringArmAccept(reactor);
+    uringArmWake(reactor);
+    for( ; ; ) {
+        wakeMessageLog(reactor);
+        evictSlowClients(reactor);
+        uringFlushSends(reactor);
+        if ((!reactor.draining.empty() || !reactor.parked.empty()) && !reactor.tick_armed) {
+            struct io_uring_sqe *sqe = uringGetSqe(reactor);
+            if (sqe != NULL) {
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->addr = (uint64_t)(uintptr_t)&tick;
+                sqe->len = 1;
+                sqe->user_data = uringUserData(URING_TICK, 0, 0);
+                reactor.tick_armed = true;
+            }
+        }
+        rosterOffline(reactor);
+        int submitted = uringSubmit(reactor, 1);
+        rosterOnline(reactor);
+        if (submitted < 0) {
+            cerr << "server: io_uring_enter failed" << endl;
+            break;
+        }
+        reactor.now_ms = monotonicMs();
+
+        unsigned head = *reactor.uring.cq_head;
+        while (head != __atomic_load_n(reactor.uring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = reactor.uring.cqes[head & *reactor.uring.cq_mask];
+            // Release the slot before handling, handlers may submit and reap more work
+            __atomic_store_n(reactor.uring.cq_head, ++head, __ATOMIC_RELEASE);
+            uringHandleCompletion(reactor, cqe);
+        }
+    }
+}
+
+/*
+ * Function: runEpollLoop
+ * Purpose: This function runs an event loop on epoll, accepting clients and dispatching their commands as
+ *          their sockets become readable.
+ * Parameters: The event loop
+*/
+static void runEpollLoop(Reactor &reactor) {
+    /*
+     * The listener is non-blocking so that one readiness event can drain the whole accept queue.
+     */
+    if (!setNonBlocking(reactor.listen_fd) || (reactor.epfd = epoll_create1(0)) < 0) {
+        cerr << "server: can't set up the event loop" << endl;
+        exit(1);
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = reactor.listen_fd;
+    struct epoll_event wake_ev = {};
+    wake_ev.events = EPOLLIN;
+    wake_ev.data.fd = reactor.wake_fd;
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, reactor.listen_fd, &ev) < 0 ||
+        epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, reactor.wake_fd, &wake_ev) < 0) {
+        cerr << "server: can't watch the listening socket" << endl;
+        exit(1);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    for( ; ; ) {
+        // Wake up once a second while closed clients are still draining, or dropped ones wait to be resumed
+        bool sweep = !reactor.draining.empty() || !reactor.zc_orphans.empty() || !reactor.parked.empty();
+        rosterOffline(reactor);
+        int nready = epoll_wait(reactor.epfd, events, MAX_EVENTS, sweep ? 1000 : -1);
+        rosterOnline(reactor);
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cerr << "server: epoll_wait failed" << endl;
+            break;
+        }
+        reactor.now_ms = monotonicMs();
+
+        for (int i = 0; i < nready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == reactor.listen_fd) {
+                acceptClients(reactor);
+            }
+            else if (fd == reactor.wake_fd) {
+                // Another event loop left replies for our clients
+                uint64_t count;
+                while (read(reactor.wake_fd, &count, sizeof count) > 0) {
+                }
+                drainMailbox(reactor);
+            }
+            else {
+                if (events[i].events & EPOLLERR) {
+                    // Zero-copy completions are queued as socket errors
+                    std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(fd);
+                    if (it != reactor.sessions.end() && !it->second.zc_pins.empty()) {
+                        epollReapZeroCopy(it->second);
+                        if (it->second.closing && it->second.out_bytes == 0 && it->second.zc_pins.empty()) {
+                            epollFinishClose(reactor, it->second);
+                            continue;
+                        }
+                    }
+                }
+                // Hang-ups are picked up by recv() returning 0 or an error
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    handleClient(reactor, fd);
+                }
+                if (events[i].events & EPOLLOUT) {
+                    // Write at the end of the iteration, together with whatever else it queues for this client
+                    std::unordered_map<int, ClientSession>::iterator it = reactor.sessions.find(fd);
+                    if (it != reactor.sessions.end() && it->second.out_bytes > 0) {
+                        markDirty(reactor, it->second);
+                    }
+                }
+            }
+        }
+        // Sessions not resumed in time leave now, so their leave goes out with this iteration's writes
+        if (!reactor.parked.empty()) {
+            sweepParked(reactor);
+        }
+        // Write out everything the handlers queued during this iteration
+        wakeMessageLog(reactor);
+        evictSlowClients(reactor);
+        epollFlushDirty(reactor);
+        if (!reactor.draining.empty() || !reactor.zc_orphans.empty()) {
+            sweepDraining(reactor);
+        }
+    }
+
+    close(reactor.epfd);
+}
+
+/*
+ * Function: runReactor
+ * Purpose: This function is the body of a worker thread. It pins the thread to its own core and runs the event loop.
+ * Parameters: The event loop
+*/
+static void runReactor(Reactor *reactor) {
+    current_reactor = reactor;
+
+    if (worker_count > 1) {
+        unsigned cores = std::thread::hardware_concurrency();
+        if (cores > 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(reactor->index % cores, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+        }
+    }
+
+    if (reactor->backend == IO_URING) {
+        runUringLoop(*reactor);
+    }
+    else {
+        runEpollLoop(*reactor);
+    }
+    // The loops only return on a fatal error
+    exit(1);
+}
+
+/*
+ * Function: printStats
+ * Purpose: This function prints the slow-consumer, registry, user list, message log, mailbox and resume counters (sent SIGUSR1 to the server to see them)
+*/
+static void printStats() {
+    cerr << "server: slow consumers: " << slow_dropped.load() << " public messages dropped, "
+         << slow_coalesced.load() << " coalesced, " << slow_disconnected.load() << " clients disconnected" << endl;
+    cerr << "server: registry: " << registry_commits.load() << " log commits, "
+         << registry_compactions.load() << " compactions" << endl;
+    cerr << "server: " << fanouts.load() << " broadcasts fanned out across event loops" << endl;
+    cerr << "server: user list: formatted " << user_list_builds.load() << " times, shared "
+         << user_list_shared.load() << " times" << endl;
+    if (!message_log_dir.empty()) {
+        cerr << "server: message log: " << message_log_records.load() << " records in " << message_log_commits.load()
+             << " commits, " << message_log_dropped.load() << " dropped" << endl;
+    }
+    if (offline_hold_ms > 0) {
+        cerr << "server: offline mailboxes: " << offline_stored.load() << " messages kept (" << offline_spilled.load()
+             << " spilled), " << offline_delivered.load() << " delivered, " << offline_refused.load() << " refused" << endl;
+    }
+    if (resume_hold_ms > 0) {
+        cerr << "server: sessions: " << resumes.load() << " resumed, " << resume_failures.load() << " resumes refused, "
+             << resume_expired.load() << " not resumed in time" << endl;
+    }
+}
+
+/*
+ * Function: openListener
+ * Purpose: This function opens, binds, and starts listening on one server socket. With several workers every
+ *          worker gets its own listener on the same port, and SO_REUSEPORT lets the kernel spread new
+ *          connections across their accept queues.
+ * Parameters: The local address, and whether the port is shared between workers
+*/
+static int openListener(const struct addrinfo *servinfo, bool reuseport) {
+    int sockfd;      /* socket listening for incoming connections */
+
+    /*
+     * Open a TCP socket (an Internet stream socket).
+     */
+    if ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) < 0) {
+        cerr << "server: can't open stream socket" << endl;
+        exit(1);
+    }
+
+    // Allow a restarted server to rebind while old connections sit in TIME_WAIT
+    int reuse = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof reuse) < 0) {
+        cerr << "server: can't share the port between workers" << endl;
+        exit(1);
+    }
+
+    /*
+     * Bind our local address so that the client can send to us.
+     */
+    if (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) < 0) {
+        cerr << "server: can't bind local address" << endl;
+        exit(1);
+    }
 
     /*
      * Listen for incoming connection.
@@ -537,24 +5028,159 @@ int main(int argc, char **argv)
         cerr << "server: error in listening" << endl;
         exit(1);
     }
+    return sockfd;
+}
 
-    ofstream REG_USERS("REGISTERED_USERS", std::ios::app);
-    // Close the file
-    REG_USERS.close();
+/*
+ * Function: main
+ * Purpose: This function keeps the server on, and has to be here
+ * Usage: server [--io=epoll|--io=uring] [--workers=N] [--slow-policy=drop|coalesce|disconnect]
+ *               [--out-hwm=BYTES] [--out-max-age=MS] [--zerocopy-min=BYTES] [--fanout-min=N]
+ *               [--history-replay=N] [--message-log=DIR] [--offline-hold=SECONDS] [--offline-memory=BYTES]
+ *               [--resume=SECONDS] [--resume-window=BYTES]
+*/
 
-    for( ; ; ) {
-        addrlen = sizeof cliaddr;
-        int newsockfd = accept(sockfd, (struct sockaddr *)&cliaddr, &addrlen);
-        if (newsockfd < 0) {
-            cerr << "server: can't accept connection" << endl;
-            continue;
+int main(int argc, char **argv)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *servinfo;
+
+    hints.ai_family = AF_UNSPEC; 	// either IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM;	// TCP stream socket
+    hints.ai_flags = AI_PASSIVE;	// fill in my IP for me
+
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--io=epoll") == 0) {
+            io_backend = IO_EPOLL;
+        }
+        else if (strcmp(argv[i], "--io=uring") == 0) {
+            io_backend = IO_URING;
+        }
+        else if (strncmp(argv[i], "--workers=", 10) == 0 && atoi(argv[i] + 10) > 0) {
+            worker_count = atoi(argv[i] + 10);
+        }
+        else if (strcmp(argv[i], "--slow-policy=drop") == 0) {
+            slow_policy = SLOW_DROP;
+        }
+        else if (strcmp(argv[i], "--slow-policy=coalesce") == 0) {
+            slow_policy = SLOW_COALESCE;
+        }
+        else if (strcmp(argv[i], "--slow-policy=disconnect") == 0) {
+            slow_policy = SLOW_DISCONNECT;
+        }
+        else if (strncmp(argv[i], "--out-hwm=", 10) == 0 && atol(argv[i] + 10) > 0) {
+            out_high_watermark = atol(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "--out-max-age=", 14) == 0 && atol(argv[i] + 14) > 0) {
+            out_max_age_ms = atol(argv[i] + 14);
+        }
+        else if (strncmp(argv[i], "--zerocopy-min=", 15) == 0 && atol(argv[i] + 15) >= 0) {
+            zerocopy_min = atol(argv[i] + 15);
+        }
+        else if (strncmp(argv[i], "--fanout-min=", 13) == 0 && atol(argv[i] + 13) >= 0) {
+            fanout_min = atol(argv[i] + 13);
+        }
+        else if (strncmp(argv[i], "--history-replay=", 17) == 0 && atol(argv[i] + 17) >= 0) {
+            history_replay = std::min<long>(atol(argv[i] + 17), HISTORY_MESSAGES);
         }
+        else if (strncmp(argv[i], "--message-log=", 14) == 0 && argv[i][14] != '\0') {
+            message_log_dir = argv[i] + 14;
+        }
+        else if (strncmp(argv[i], "--offline-hold=", 15) == 0 && atol(argv[i] + 15) >= 0) {
+            offline_hold_ms = atol(argv[i] + 15) * 1000ULL;
+        }
+        else if (strncmp(argv[i], "--offline-memory=", 17) == 0 && atol(argv[i] + 17) >= 0) {
+            offline_memory_budget = atol(argv[i] + 17);
+        }
+        else if (strncmp(argv[i], "--resume=", 9) == 0 && atol(argv[i] + 9) >= 0) {
+            resume_hold_ms = atol(argv[i] + 9) * 1000ULL;
+        }
+        else if (strncmp(argv[i], "--resume-window=", 16) == 0 && atol(argv[i] + 16) > 0) {
+            resume_window = atol(argv[i] + 16);
+        }
+        else {
+            cerr << "Usage: server [--io=epoll|--io=uring] [--workers=N] [--slow-policy=drop|coalesce|disconnect]" << endl
+                 << "              [--out-hwm=BYTES] [--out-max-age=MS] [--zerocopy-min=BYTES] [--fanout-min=N]" << endl
+                 << "              [--history-replay=N] [--message-log=DIR] [--offline-hold=SECONDS] [--offline-memory=BYTES]" << endl
+                 << "              [--resume=SECONDS] [--resume-window=BYTES]" << endl;
+            exit(1);
+        }
+    }
 
-        // Create a new thread to handle the client
-        std::thread client_thread(handleClient, newsockfd, cliaddr);
-        client_thread.detach();  // Detach the thread to allow it to run independently
+    if ((getaddrinfo(NULL, MY_PORT, &hints, &servinfo)) != 0) {
+        cerr << "server: can't get address info" << endl;
+        exit(1);
     }
 
-    close(sockfd);
+    historyInit(public_history, HISTORY_BYTES, HISTORY_MESSAGES);
+    raiseFileLimit();
+    struct rlimit rl;
+    fd_owners_size = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) ? rl.rlim_cur : FD_OWNERS_MAX;
+    fd_owners_size = std::min<size_t>(fd_owners_size, FD_OWNERS_MAX);
+    fd_owners = new std::atomic<uint64_t>[fd_owners_size];
+    for (size_t fd = 0; fd < fd_owners_size; fd++) {
+        fd_owners[fd].store(0, std::memory_order_relaxed);
+    }
+
+    bool uring_warned = false;
+    for (int i = 0; i < worker_count; i++) {
+        Reactor *reactor = new Reactor;
+        reactor->index = i;
+        reactor->mailbox.slots.reset(new MailSlot[MAILBOX_SLOTS]);
+        for (size_t slot = 0; slot < MAILBOX_SLOTS; slot++) {
+            reactor->mailbox.slots[slot].seq.store(slot, std::memory_order_relaxed);
+        }
+        reactor->listen_fd = openListener(servinfo, worker_count > 1);
+        if ((reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            cerr << "server: can't create the wakeup descriptor" << endl;
+            exit(1);
+        }
+        reactor->backend = IO_EPOLL;
+        if (io_backend == IO_URING) {
+            if (uringSetup(*reactor)) {
+                reactor->backend = IO_URING;
+            }
+            else if (!uring_warned) {
+                cerr << "server: io_uring is not supported by this kernel, falling back to epoll" << endl;
+                uring_warned = true;
+            }
+        }
+        // SENDMSG_ZC arrived in Linux 6.1; MSG_ZEROCOPY is checked per socket
+        reactor->zerocopy = zerocopy_min > 0 && (reactor->backend == IO_EPOLL || kernelAtLeast(6, 1));
+        reactors.push_back(reactor);
+    }
+
+    freeaddrinfo(servinfo); // Done with this structure
+
+    // No thread but this one sees SIGUSR1; this thread waits for it and prints the counters. The mask is set
+    // before the first thread starts, so every background thread and worker inherits it.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // From here on registration only looks at memory, and the file is written in the background
+    if (!openRegistry()) {
+        return 1;
+    }
+    if (!message_log_dir.empty() && !openMessageLog()) {
+        return 1;
+    }
+    if (offline_hold_ms > 0) {
+        openOfflineSpill();
+        // SIGUSR1 is blocked by now, so the sweeper inherits the mask
+        std::thread(offlineSweeper).detach();
+    }
+
+    for (size_t i = 0; i < reactors.size(); i++) {
+        reactors[i]->thread = std::thread(runReactor, reactors[i]);
+    }
+    for( ; ; ) {
+        int sig;
+        if (sigwait(&signals, &sig) == 0 && sig == SIGUSR1) {
+            printStats();
+        }
+    }
     return 0;
 }